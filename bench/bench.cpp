@@ -0,0 +1,280 @@
+/**
+ * bench.cpp
+ *
+ * Native benchmark of the decode -> volume chain of esp32-stream-system,
+ * built by env:native. Each capture named on the command line is read in
+ * JITTER_CHUNK pieces the way the audio task copies them out of the jitter
+ * buffer, from the first whole frame found by src/framesync.h, decoded by
+ * helix, scaled by the gain stage from src/gain.h, optionally resampled
+ * and dropped. Reports throughput, the time taken per frame and the heap
+ * traffic, so decoder and volume stage changes can be compared on
+ * repeatable input without hardware or a live station.
+ *
+ *   pio run -e native
+ *   .pio/build/native/program [-v level] [-r] [-d ppm] capture.mp3 ...
+ *
+ *   -v level  volume knob position 0..100, default 70
+ *   -r        turn the knob every frame, so every block is ramped
+ *   -d ppm    resample for that much clock drift, as src/resample.h
+ *
+ * Record a capture with e.g. curl -s --max-time 60 <station url> > x.mp3
+ * (a station that sends icy metadata must be asked not to).
+ * The same files replay on the device with env:esp32replay.
+ *
+ * Heap figures come from wrapping malloc and friends at link time, see
+ * build_flags in platformio.ini, which needs the gnu linker.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <vector>
+#include <algorithm>
+#include "MP3DecoderHelix.h"
+#include "gain.h"
+#include "resample.h"
+#include "framesync.h"
+
+using namespace libhelix;
+
+#define BENCH_CHUNK 1024        // as JITTER_CHUNK in the sketch
+#define BENCH_VOLUME 70         // default knob position
+#define BENCH_STRETCH 256       // as RESAMPLE_BLOCK in the sketch
+
+// heap traffic, counted by the malloc wrappers below
+size_t allocCount = 0;          // calls that returned memory
+size_t allocBytes = 0;          // bytes they asked for
+size_t allocLive = 0;           // bytes not yet freed
+size_t allocPeak = 0;           // most bytes live at once
+
+// one capture being measured
+struct bench_t {
+  int32_t curve[VOLUME_LEVELS]; // Q15 gain of each knob position
+  int32_t gain;                 // Q15 reached at the end of the last block
+  int level;                    // knob position
+  bool ramp;                    // alternate the level every frame
+  uint64_t mark;                // ns when the current frame started
+  uint64_t gainNs;              // time spent in gainApply()
+  int drift;                    // resampling ratio, ppm, 0 is off
+  resample_t stretch;           // resampler state
+  int16_t stretchBuf[RESAMPLE_CHANNELS * RESAMPLE_ROOM(BENCH_STRETCH)];
+  uint64_t stretchNs;           // time spent in resampleRun()
+  size_t outFrames;             // frames after resampling
+  std::vector<uint32_t> frameNs;// decode + gain time of each frame
+  size_t pcmFrames;             // pcm frames produced
+  int rate;                     // sample rate of the last frame
+  int ch;                       // channels of the last frame
+};
+
+
+extern "C" {
+void* __real_malloc(size_t);
+void* __real_calloc(size_t, size_t);
+void* __real_realloc(void*, size_t);
+void __real_free(void*);
+
+/*
+ * Count every allocation made by the decoder and the bench
+ */
+void* __wrap_malloc(size_t n) {
+  void* p = __real_malloc(n);
+  if (p) {
+    allocCount++;
+    allocBytes += n;
+    allocLive += malloc_usable_size(p);
+    allocPeak = std::max(allocPeak, allocLive);
+  }
+  return p;
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+  void* p = __real_calloc(n, size);
+  if (p) {
+    allocCount++;
+    allocBytes += n * size;
+    allocLive += malloc_usable_size(p);
+    allocPeak = std::max(allocPeak, allocLive);
+  }
+  return p;
+}
+
+void* __wrap_realloc(void* old, size_t n) {
+  size_t before = old ? malloc_usable_size(old) : 0;
+  void* p = __real_realloc(old, n);
+  if (p) {
+    allocCount++;
+    allocBytes += n;
+    allocLive += malloc_usable_size(p) - before;
+    allocPeak = std::max(allocPeak, allocLive);
+  }
+  return p;
+}
+
+void __wrap_free(void* p) {
+  if (p) allocLive -= malloc_usable_size(p);
+  __real_free(p);
+}
+}
+
+
+/*
+ * Monotonic time in ns
+ */
+uint64_t nowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/*
+ * Decoder output, the gain stage and a null sink
+ */
+void pcmSink(MP3FrameInfo& info, short* pcm, size_t len, void* ref) {
+  bench_t* b = (bench_t*)ref;
+  int ch = (info.nChans > 0) ? info.nChans : 2;
+  size_t frames = len / ch;
+
+  int level = b->level;
+  if (b->ramp && (b->frameNs.size() & 1)) level = level / 2;
+  uint64_t start = nowNs();
+  gainApply((int16_t*)pcm, frames, ch, &b->gain, b->curve[level]);
+  uint64_t end = nowNs();
+  b->gainNs += end - start;
+  if (b->drift && ch <= RESAMPLE_CHANNELS) {
+    for (size_t f=0; f<frames; f+=BENCH_STRETCH) {
+      size_t n = std::min(frames - f, (size_t)BENCH_STRETCH);
+      b->outFrames += resampleRun(&b->stretch, (int16_t*)pcm + f * ch, n, ch,
+                                  b->stretchBuf, b->drift);
+    }
+    start = end;
+    end = nowNs();
+    b->stretchNs += end - start;
+  }
+
+  // the frame took from the end of the last one, or the start of the write
+  b->frameNs.push_back((uint32_t)(end - b->mark));
+  b->mark = nowNs();  // growing the log is not the decoder's time
+  b->pcmFrames += frames;
+  b->rate = info.samprate;
+  b->ch = ch;
+}
+
+
+/*
+ * Run one capture through the chain and print its figures
+ */
+bool benchFile(const char* path, int level, bool ramp, int drift) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "%s: cannot open\n", path);
+    return false;
+  }
+
+  bench_t* b = new bench_t();
+  gainCurveBuild(b->curve);
+  b->level = level;
+  b->ramp = ramp;
+  b->drift = drift;
+  resampleReset(&b->stretch);
+  b->gain = b->curve[level];
+  b->frameNs.reserve(1 << 16);  // about 25 minutes of 44.1 kHz mp3
+
+  size_t countBefore = allocCount;
+  size_t bytesBefore = allocBytes;
+  size_t liveBefore = allocLive;
+  allocPeak = allocLive;
+
+  // line up on the first whole frame, as the sketch does
+  static uint8_t head[SYNC_SCAN_BYTES];
+  sync_t info = {};
+  size_t skipped = 0, skip;
+  int found;
+  do {
+    fseek(f, skipped, SEEK_SET);
+    size_t n = fread(head, 1, sizeof(head), f);
+    found = syncScan(head, n, false, true, &info, &skip);
+    skipped += skip;
+  } while (found == SYNC_SKIP && skip > 0);
+  fseek(f, skipped, SEEK_SET);
+
+  MP3DecoderHelix mp3(pcmSink);
+  mp3.setReference(b);
+  mp3.begin();
+
+  uint8_t buf[BENCH_CHUNK];
+  size_t got, bytes = 0;
+  uint64_t start = nowNs();
+  while ((got = fread(buf, 1, sizeof(buf), f)) > 0) {
+    b->mark = nowNs();
+    mp3.write(buf, got);
+    bytes += got;
+  }
+  uint64_t wall = nowNs() - start;
+  mp3.end();
+  fclose(f);
+
+  if (b->frameNs.empty()) {
+    fprintf(stderr, "%s: no frames decoded\n", path);
+    delete b;
+    return false;
+  }
+
+  std::vector<uint32_t>& ns = b->frameNs;
+  size_t n = ns.size();
+  uint64_t sum = 0;
+  for (size_t i=0; i<n; i++) sum += ns[i];
+  std::sort(ns.begin(), ns.end());
+  double secs = wall / 1e9;
+  double played = (double)b->pcmFrames / (b->rate > 0 ? b->rate : 44100);
+
+  printf("%s: %zu bytes, %zu frames, %d Hz %d ch\n", path, bytes, n, b->rate, b->ch);
+  if (found == SYNC_FOUND)
+    printf("  sync after %zu bytes: %d Hz %d ch %d kbps\n", skipped, info.rate,
+           info.channels, info.kbps);
+  else
+    printf("  no frame sync\n");
+  printf("  throughput %.2f MB/s, %.1f s of audio in %.3f s, %.0fx real time\n",
+         bytes / secs / 1e6, played, secs, played / secs);
+  printf("  frame us: min %.1f mean %.1f p50 %.1f p99 %.1f max %.1f\n",
+         ns[0] / 1e3, sum / 1e3 / n, ns[n / 2] / 1e3, ns[n * 99 / 100] / 1e3,
+         ns[n - 1] / 1e3);
+  printf("  gain ns/frame %.1f\n", (double)b->gainNs / b->pcmFrames);
+  if (drift) 
+    printf("  resample ns/frame %.1f, %zu frames out, %.1f ppm\n",
+           (double)b->stretchNs / b->pcmFrames, b->outFrames,
+           (1.0 - (double)b->outFrames / b->pcmFrames) * 1e6);
+  printf("  heap: %zu allocations, %zu bytes, peak %zu live, %zd left\n",
+         allocCount - countBefore, allocBytes - bytesBefore,
+         allocPeak - liveBefore, (ssize_t)(allocLive - liveBefore));
+  delete b;
+  return true;
+}
+
+
+int main(int argc, char** argv) {
+  int level = BENCH_VOLUME;
+  bool ramp = false;
+  int drift = 0;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-r") == 0) ramp = true;
+    else if (strcmp(argv[i], "-v") == 0 && i + 1 < argc) level = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) drift = atoi(argv[++i]);
+    else break;
+  }
+  if (i >= argc || level < 0 || level >= VOLUME_LEVELS || abs(drift) > RESAMPLE_MAX_PPM) {
+    fprintf(stderr, "usage: %s [-v level] [-r] [-d ppm] capture.mp3 ...\n", argv[0]);
+    return 2;
+  }
+
+#ifdef GAIN_FLOAT
+  printf("gain: float\n");
+#endif
+  int failed = 0;
+  for (; i < argc; i++) if (!benchFile(argv[i], level, ramp, drift)) failed++;
+  return failed ? 1 : 0;
+}
@@ -19,41 +19,266 @@
 #include <Preferences.h>
 #include <WiFi.h>
 #include <WiFiManager.h>
+#include <ESPAsyncWebServer.h>
+#include <Update.h>
 #include "AudioTools.h" 
 #include "AudioTools/AudioCodecs/CodecMP3Helix.h" 
-#include "AiEsp32RotaryEncoder.h"
+#include "AudioTools/AudioCodecs/CodecAACHelix.h" 
+#ifndef OGG_VORBIS
+#define OGG_VORBIS 0            // 1 to build vorbis, set by env:esp32ogg
+#endif
+#ifndef OGG_OPUS
+#define OGG_OPUS 0              // 1 to build opus, set by env:esp32ogg
+#endif
+#if OGG_VORBIS
+#include "AudioTools/AudioCodecs/CodecVorbis.h"
+#endif
+#if OGG_OPUS
+#include "AudioTools/AudioCodecs/CodecOpusOgg.h"
+#endif
 #include <Wire.h>
 #include "SSD1306Ascii.h"
 #include "SSD1306AsciiWire.h"
 #include <nvs_flash.h>
+#include <lwip/sockets.h>
+#include <lwip/dns.h>
+#include <lwip/tcpip.h>
+#include <mbedtls/ssl.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <esp_pm.h>
+#include <soc/gpio_struct.h>
+#include <LittleFS.h>
+#include "gain.h"
+#include "resample.h"
+#include "framesync.h"
 
 // Function prototypes
-void saveParamsCallback(void);
-void metadataCallback(MetaDataType, const char*, int);
 void runSleepTimer(bool);
 void oledStatusDisplay(void);
 void StreamPortalMessage(void);
 void wifiPortalMessage(void);
-String timerTimeLeft(void);
+void timerTimeLeft(char*, size_t);
 void menuDisplay(int);
 bool checkProtocol(int);
 int settingGet(const char*);
 void settingPut(const char*, int);
+int settingFind(const char*);
+void settingsLoad(void);
+void settingsFlush(void);
+void settingsService(void);
 void populateStreams(void);
 void populatePrefs(void);
-void streamsPut(int, const char*, const char*);
-char* streamsGetTag(int);
-char* streamsGetUrl(int);
+void streamsClear(void);
+bool streamsAdd(const char*, const char*);
+void stationsEmpty(struct stationSet_t*);
+bool stationsAppend(struct stationSet_t*, const char*, const char*);
+struct stationSet_t* stationsSpare(void);
+void stationsSwap(void);
+void stationsService(void);
+const char* streamsGetTag(int);
+const char* streamsGetUrl(int);
 void initializeStreams(void);
-String version(void);
+bool stationsReserve(struct stationSet_t*, size_t, int);
+bool stationsLoad(void);
+bool stationsIndex(void);
+bool stationsUpgrade(size_t);
+int stationsMigrate(void);
+bool portalGate(AsyncWebServerRequest*);
+void webBegin(void);
+bool webPost(int, int);
+const AsyncWebParameter* webArg(AsyncWebServerRequest*, const char*);
+void webService(void);
+void portalPage(AsyncWebServerRequest*);
+size_t portalChunk(struct portalPage_t*, uint8_t*, size_t);
+void portalLine(struct portalPage_t*);
+size_t portalEscape(char*, size_t, const char*);
+void portalSaveBody(AsyncWebServerRequest*, uint8_t*, size_t, size_t, size_t);
+void portalSaveDone(AsyncWebServerRequest*);
+void portalFormChar(struct portalForm_t*, char);
+void portalFormField(struct portalForm_t*);
+void portalFormPair(struct portalForm_t*, const char*, const char*);
+void portalUpdatePage(AsyncWebServerRequest*);
+void portalUpdateDone(AsyncWebServerRequest*);
+void portalUpdateChunk(AsyncWebServerRequest*, const String&, size_t, uint8_t*, size_t, bool);
+uint32_t crc32(const uint8_t*, size_t);
+void version(char*, size_t);
+bool heapGuard(bool);
 void systemPowerDown(void);
 void wipeNVS(void);
+void audioTask(void*);
+bool codecSelect(int);
+int codecSniff(const uint8_t*, size_t);
+int codecFromType(const char*);
+int codecBitrate(void);
+void syncAnnounce(struct sync_t*, size_t);
+size_t decodeWrite(const uint8_t*, size_t);
+void replayCaptures(void);
+void audioSend(int, long);
+void rateReset(void);
+void rateAdd(size_t, bool);
+bool rateStalled(int);
+unsigned long retryDelay(int);
+void statsAdd(struct hist_t*, uint32_t);
+void statsAddBin(struct hist_t*, int, uint32_t);
+void statsNet(size_t);
+size_t statsJson(char*, size_t);
+size_t statsHist(char*, size_t, const char*, struct hist_t*);
+void statsPrint(void);
+void pmBegin(void);
+bool wifiCacheLoad(struct wifiCache_t*);
+void wifiCacheSave(void);
+bool wifiStatic(IPAddress*, IPAddress*, IPAddress*, IPAddress*);
+bool wifiFastConnect(void);
+bool wifiResume(void);
+void bootPrint(void);
+void pmBusy(bool);
+void outputRun(bool);
+void outputConfigure(AudioInfo);
+void profileSet(int);
+void profileSelect(int);
+void profileWatch(void);
+void profileHandle(AsyncWebServerRequest*);
+void driftReset(void);
+void driftStep(bool);
+bool roomOpen(void);
+void roomClose(void);
+bool roomBegin(void);
+void roomRestart(void);
+void roomSend(const uint8_t*, size_t, int64_t);
+bool roomReceive(void);
+bool roomFeed(void);
+void roomSteer(int64_t);
+bool roomFollow(void);
+void roomSet(int);
+void roomHandle(AsyncWebServerRequest*);
+void loopWait(void);
+void loopWake(void);
+void timerStart(int, unsigned long, unsigned long = 0);
+void timerStop(int);
+bool timerDue(int);
+void portalSwitchISR(void);
+void inputBegin(void);
+void inputPush(uint32_t, int8_t, int8_t);
+void readEncoderISR(void);
+void readButtonISR(void);
+void gpioWaitLevel(int, bool);
+bool inputRead(struct input_t*);
+void inputFlush(void);
+void inputPress(uint32_t, bool);
+void inputTurn(int, uint32_t);
+bool shiftOpen(void);
+void shiftClose(void);
+void shiftService(void);
+void shiftStore(const uint8_t*);
+size_t shiftLoad(uint8_t*, size_t);
+void shiftToggle(void);
+void shiftHandle(AsyncWebServerRequest*);
+size_t shiftWritePtr(uint8_t**);
+void shiftCommit(size_t);
+void shiftFeed(void);
+void shiftEnd(void);
+void statsHandle(AsyncWebServerRequest*);
+void audioStop(void);
+void jitterBegin(void);
+void jitterReset(void);
+void jitterSetBitrate(int);
+size_t jitterFill(void);
+size_t jitterWritePtr(uint8_t**);
+void jitterCommit(size_t);
+void jitterPut(const uint8_t*, size_t);
+size_t jitterReadPtr(uint8_t**);
+void jitterConsume(size_t);
+struct conn_t;
+bool connOpen(conn_t*, const char*);
+bool connStart(conn_t*, const char*);
+void connLocation(conn_t*, const char*);
+void connPlaylist(conn_t*);
+const char* resolveFind(uint32_t);
+void resolveStore(uint32_t, const char*);
+void resolveDrop(uint32_t);
+void resolveLoad(void);
+void resolveService(void);
+void connStep(conn_t*);
+int connRead(conn_t*, uint8_t*, size_t);
+void connClose(conn_t*);
+void connMove(conn_t*, const conn_t*);
+bool connFail(conn_t*, const char*);
+void connHeader(conn_t*);
+bool connRequest(conn_t*);
+int connRecv(conn_t*, void*, size_t);
+bool tlsBegin(void);
+bool tlsStart(conn_t*);
+void tlsStep(conn_t*);
+void tlsFree(conn_t*);
+int tlsSend(void*, const unsigned char*, size_t);
+int tlsRecv(void*, unsigned char*, size_t);
+int tlsRandom(void*, unsigned char*, size_t);
+void connDnsFound(const char*, const ip_addr_t*, void*);
+void dnsStart(void*);
+void dnsResult(uint32_t, const ip_addr_t*);
+void warmWant(int);
+void warmStep(void);
+bool warmAdopt(int);
+void warmDrop(void);
+bool warmBusy(void);
+struct probe_t* probeFind(uint32_t, bool);
+void probeRecord(uint32_t, bool, unsigned long, int, int, int);
+void probeStep(bool);
+bool probeBusy(void);
+bool probeDead(int);
+void probesLoad(void);
+void probesService(void);
+void probesHandle(AsyncWebServerRequest*);
+size_t probesChunk(struct probesPage_t*, uint8_t*, size_t);
+void probesLine(struct probesPage_t*);
+const char* menuLabel(int, char*, size_t);
+int icyRead(conn_t*);
+void icyParse(conn_t*, const char*, int);
+void icyValueEnd(conn_t*);
+void icyBlockEnd(conn_t*);
+void icyPublish(conn_t*);
+bool nowPlayingDisplay(void);
+void oledClear(void);
+void oledFrame(void);
+void oledRow(int, const char*, bool = false);
+int wifiSignal(void);
 
 // display I/O
 #define I2C_ADDRESS 0x3C        // ssd1306 oled
 #define SDA_PIN 18              // i2c data
 #define SCL_PIN 19              // i2c clock
 
+// oled display model
+// Screens built from rows are mirrored in ram and only the span of columns
+// that changed is sent, so turning the knob rewrites just the digits.
+#define OLED_ROWS 4             // 128x32 panel with the 5x7 font
+#define OLED_COLS 21            // characters per row
+#define OLED_CHAR_WIDTH 6       // pixels per character, 5 + spacing
+#define RSSI_TIMER 2000         // ms between wifi signal readings
+
+// capture replay
+// Built with env:esp32replay the audio task first decodes every capture
+// in LittleFS into a null sink and reports the same numbers as the native
+// bench, then carries on as usual.
+#ifndef REPLAY_CAPTURES
+#define REPLAY_CAPTURES 0       // set by env:esp32replay
+#endif
+
+// heap guard
+// Weeks of play fragment the heap if the steady path allocates. Built with
+// env:esp32heap, malloc and friends are wrapped at link time and any
+// allocation the audio task makes while it reads, decodes and plays an
+// established stream stops the unit, printing the caller's address for
+// addr2line. Connects, probes, format changes and the leader's udp sends
+// allocate inside lwip and the i2s driver, and stay outside the guard.
+#ifndef HEAP_GUARD
+#define HEAP_GUARD 0            // set by env:esp32heap
+#endif
+
+// build version
+#define VERSION_SIZE 14         // "YYYYMMDD.HHMM" and its nul
+
 // user control inputs
 #define NVS_CLR_PIN 17          // clear non-volatile memory when low on reset
 #define STREAM_PIN 16           // set default streams when low on reset
@@ -62,21 +287,382 @@ void wipeNVS(void);
 // portal states
 #define PORTAL_DOWN 0           // portal is off
 #define PORTAL_UP 1             // portal is running
-#define PORTAL_SAVE 2           // save pending
-#define PORTAL_IDLE 4           // waiting for switch reset
 
 // timer settings
 #define OLED_TIMER 5000         // display timeout in milliseconds
 #define SLEEP_TIMER 3600000     // one hour in milliseconds
 
-// System is hard coded to 25 streams (TOTAL_ITEMS)
-// Each item in the streamsX array contains a text name and a url,
-// the name and url elements are each STREAM_ELEMENT_SIZE in length
-#define STREAM_ITEM_SIZE 100          // line item width
-#define STREAM_ELEMENT_SIZE 50        // max length of name, url (49 char + nul)
-#define TOTAL_ITEMS 36                // number of line items in streamsX
+// audio task
+// The network -> jitter -> decoder -> volume -> i2s pipeline runs in its own task,
+// pinned away from loop() (which Arduino runs on core 1) and at a higher
+// priority, so oled, nvs and portal work cannot starve the decoder.
+#define AUDIO_TASK_CORE 0       // core the audio pipeline is pinned to
+#define AUDIO_TASK_PRIORITY 3   // above the arduino loop task (1)
+#define AUDIO_TASK_STACK 12288  // bytes, helix and the tls handshake need a deep stack
+#define AUDIO_QUEUE_LEN 8       // pending commands from the ui
+#define AUDIO_STOP_WAIT 500     // max ms to wait for the task to stop
+
+// audio task commands
+#define AUDIO_CMD_PLAY 1        // start stream, arg = stream index
+#define AUDIO_CMD_STOP 2        // stop stream download
+#define AUDIO_CMD_VOLUME 3      // set volume, arg = 0..100
+#define AUDIO_CMD_WARM 4        // pre-connect around menu item, arg = index
+#define AUDIO_CMD_COOL 5        // menu closed, drop warm connections
+#define AUDIO_CMD_PROFILE 6     // output profile, arg = PROFILE_xxx
+#define AUDIO_CMD_SHIFT 7       // time shift, arg = SHIFT_OP_xxx
+
+// jitter buffer
+// A ring buffer between urlstream and the decoder rides out wifi hiccups.
+// Playback starts once the prefill mark is reached and pauses to rebuffer
+// when the fill drops under the low mark. Marks are set in milliseconds of
+// audio and converted to bytes from the stream bitrate.
+#define JITTER_PSRAM_SIZE 262144  // buffer bytes when psram is present
+#define JITTER_RAM_SIZE 32768     // buffer bytes in internal ram
+#define JITTER_MIN_SIZE 8192      // give up shrinking the buffer below this
+#define JITTER_PREFILL_MS 1500    // audio buffered before playback starts
+#define JITTER_LOW_MS 100         // rebuffer when fill drops under this
+#define JITTER_DEFAULT_KBPS 128   // assumed bitrate until frames are parsed
+#define JITTER_CHUNK 1024         // max bytes moved per copy step
+
+// time shift
+// A long press pauses the stream, which goes on being recorded, and the
+// next one plays on from where it stopped, behind live, until it has
+// caught up. The audio task fills SHIFT_PAGE pages from the network and
+// loop() stores them whole, in psram when there is some, else in a
+// circular file on LittleFS, and reads them back for the jitter buffer.
+// Nothing is recorded while playing live, so flash only wears while
+// shifted, and the robust dma rides out the stalls its writes cause.
+// The store takes what room there is, so SHIFT_MINUTES is a ceiling: at
+// 128 kbps 4 MB of psram keeps about four minutes, the 128 KB LittleFS
+// partition of min_spiffs.csv, which keeps both ota slots, only about
+// eight seconds. The display and /shift say how much was had.
+// POST /shift op=pause on WEB_PORT, with the portal open, does the same
+// as the button.
+#define SHIFT_LIVE 0            // playing the network
+#define SHIFT_PAUSED 1          // silent, recording
+#define SHIFT_BEHIND 2          // playing the recording, still recording
+#define SHIFT_OP_PAUSE 0        // AUDIO_CMD_SHIFT args
+#define SHIFT_OP_RESUME 1
+#define SHIFT_OP_LIVE 2         // drop the recording, back to the network
+#define SHIFT_PAGE 4096         // bytes stored at once, a flash sector
+#define SHIFT_MINUTES 10        // most audio kept
+#define SHIFT_MIN_PAGES 8       // no pause with less room than this
+#define SHIFT_FS_SPARE 16384    // LittleFS room left for its own blocks
+#define SHIFT_PSRAM_SPARE 65536 // psram left for everything else
+#define SHIFT_FILE "/shift.bin" // the recording on LittleFS
+
+// output profiles
+// The i2s dma is sized from the stream format each time the decoder
+// reports it. Low latency keeps the dma and the prefill short so that a
+// station switch is heard at once, robust adds a deep dma and the full
+// prefill to ride out a weak link. Auto plays low latency and turns robust
+// for the rest of the station once it rebuffers or underruns.
+// Pick one with 'p' on the serial port or, with the portal open, POST
+// /profile mode=low on WEB_PORT.
+#define PROFILE_AUTO 0          // low until the link proves weak
+#define PROFILE_LOW 1           // small dma, fast station switch
+#define PROFILE_ROBUST 2        // deep dma and prefill
+#define PROFILE_COUNT 3
+#define DMA_FRAMES_MIN 64       // per dma buffer, keeps the interrupt rate sane
+#define DMA_FRAMES_MAX 1024     // per dma buffer, driver limit
+#define DMA_BUFFERS_MIN 3       // one refilling while two play
+#define DMA_BUFFERS_MAX 16
+#define DMA_DEFAULT_RATE 44100  // until the decoder reports the format
+#define I2S_PIN_BCK 26          // BCLK  -max98357 pins
+#define I2S_PIN_WS 25           // LRC
+#define I2S_PIN_DATA 22         // DIN
+
+// clock drift
+// The station encoder and the i2s clock disagree by up to a few hundred
+// ppm, so over an hour the jitter buffer creeps full or runs dry. Once
+// playback has settled the smoothed fill is taken as the set point, and a
+// PI controller plays that much faster or slower to hold it there, see
+// resample.h. Tuned slow, about a quarter hour, so tcp bursts stay out.
+#define DRIFT_PERIOD_MS 1000    // control step
+#define DRIFT_SETTLE_MS 30000   // playing time before the set point is taken
+#define DRIFT_SMOOTH 16         // steps averaged into the fill
+#define DRIFT_KP 1.5f           // ppm per ms of fill error
+#define DRIFT_KI 0.0012f        // ppm per ms of error, each step
+#define DRIFT_MAX_PPM 500       // ratio limit, under a cent of pitch
+#define RESAMPLE_BLOCK 256      // frames stretched at a time
+
+// multi-room
+// One unit, the leader, plays the station and multicasts each chunk it
+// hands its decoder, stamped with the time it will be heard there. The
+// followers join the group instead of a station, feed the same chunks to
+// their own decoder on the leader's timeline and steer the drift resampler
+// to stay on it. The leader runs a deep dma so the packets have time to
+// arrive, the followers a shallow one and no wifi power save. Lost packets
+// are not sent again, the decoder skips to the next frame and a follower
+// that drifts off the timeline starts over.
+// Pick the role with 'm' on the serial port or, with the portal open, POST
+// /room mode=leader on WEB_PORT.
+#define ROOM_SOLO 0             // fetch and play alone
+#define ROOM_LEADER 1           // fetch, play and multicast
+#define ROOM_FOLLOWER 2         // play what the leader sends
+#define ROOM_COUNT 3
+#define ROOM_GROUP "239.255.42.1" // multicast group, site local
+#define ROOM_PORT 5004          // udp port
+#define ROOM_MAGIC 0x52544541   // "AETR"
+#define ROOM_LEAD_MS 250        // leader dma, the followers' time to receive
+#define ROOM_MARKS 128          // chunks a follower may hold
+#define ROOM_LATE_MS 5          // a first chunk later than this is dropped
+#define ROOM_RESYNC_MS 40       // off the timeline by more, start over
+#define ROOM_OFFSET_PACKETS 64  // clock offset, least delay over this many
+#define ROOM_SMOOTH 8           // chunks averaged into the timeline error
+#define ROOM_KP 50.0f           // ppm per ms off the timeline
+#define ROOM_KI 0.05f           // ppm per ms, each chunk
+
+// stall detection and reconnect
+// The bytes arriving for the stream are counted over a sliding window. A
+// stream that carries far less than its bitrate while the jitter buffer
+// has room for more has stalled. A stalled or lost stream is reconnected
+// with a jittered exponential backoff, and the jitter buffer keeps
+// playing meanwhile, so a short outage is bridged without a gap.
+#define RATE_BUCKET_MS 500      // width of one window bucket
+#define RATE_BUCKETS 8          // buckets in the window, 4 seconds
+#define STALL_PERCENT 25        // stalled under this share of the bitrate
+#define RETRY_BASE_MS 500       // first reconnect delay
+#define RETRY_MAX_MS 16000      // longest reconnect delay
+#define RETRY_LIMIT 8           // reconnects in a row before giving up
+#define RETRY_HEALTHY_MS 30000  // up this long and the backoff starts over
+
+// wifi fast connect
+// The access point, channel and address of the last good connection are
+// kept in prefs. Boot joins that ap directly, with no scan and no dhcp,
+// and only falls back to WiFiManager when that fails. A cached lease is
+// reused WIFI_LEASE_BOOTS times, then dhcp is asked again to refresh it.
+#define WIFI_FAST_TIMEOUT 3000  // ms to join the cached ap
+#define WIFI_RESUME_TIMEOUT 5000  // ms to rejoin after a power down
+#define WIFI_LEASE_BOOTS 8      // boots on a cached lease before dhcp again
+#define WIFI_STATIC_IP ""       // e.g. "192.168.1.50", empty for dhcp
+#define WIFI_STATIC_GATEWAY ""  // used with WIFI_STATIC_IP
+#define WIFI_STATIC_MASK "255.255.255.0"
+#define WIFI_STATIC_DNS ""      // empty uses the gateway
+#define WIFI_CACHE_MAGIC 0x57494649  // "WIFI"
+
+// power management
+// The cpu idles at PM_CPU_MIN_MHZ and only decoding holds a lock for the
+// full clock. Between events loop() blocks, so the idle task runs and may
+// light-sleep the chip. The i2s driver keeps the APB clock up while its
+// dma runs, which rules out light sleep while audio plays, so the output
+// is stopped whenever there is no stream.
+#define PM_CPU_MAX_MHZ 240      // while decoding
+#define PM_CPU_MIN_MHZ 80       // otherwise, the least that keeps APB at 80
+#define PM_LIGHT_SLEEP true     // needs a core built with tickless idle
+
+// loop timers
+// loop() blocks until its nearest timer is due or something wakes it: the
+// encoder and portal switch isrs, the audio task, the web server or the
+// serial port's receive callback, all through loopWake(). The timers are
+// one shot unless given a period, and keep their deadline however often
+// loop() runs in between. Nothing is polled.
+#define TIMER_OLED 0            // blank the display
+#define TIMER_SLEEP 1           // the sleep timer runs out
+#define TIMER_SETTINGS 2        // settings have been quiet long enough
+#define TIMER_COUNT 3
+
+// one software timer of loop()
+struct loopTimer_t {
+  unsigned long due;            // millis() it fires at
+  unsigned long period;         // ms to the next one, 0 is one shot
+  bool armed;                   // due means something
+};
+
+// statistics
+// Counters and histograms cheap enough to leave on: a sample costs a
+// couple of adds and a count-leading-zeros. Send 's' over serial, or
+// GET /stats on WEB_PORT, for a json dump. Readers do not lock, so a
+// dump taken while the audio task writes may be off by a sample.
+#define STATS_BINS 16           // bins per histogram
+#define STATS_JSON_SIZE 2048    // json text buffer
+#define STATS_FILL_BINS 10      // jitter fill bins, tenths of the buffer
+
+// decoders
+// The decoder is picked per stream from the Content-Type, or when that
+// says nothing useful, from the first bytes. Only the picked decoder is
+// begun, which is when helix and friends allocate their buffers, and a
+// format that cannot be decoded fails the stream at once. An mp3 or aac
+// stream is then lined up on a whole frame (src/framesync.h) before the
+// decoder sees it, and the headers give the format ahead of the first pcm.
+#define CODEC_NONE -1           // not a format we can play
+#define CODEC_UNKNOWN 0         // not known yet, sniff the first bytes
+#define CODEC_MP3 1             // helix mp3
+#define CODEC_AAC 2             // helix aac, adts framed
+#define CODEC_VORBIS 3          // ogg vorbis, with OGG_VORBIS
+#define CODEC_OPUS 4            // ogg opus, with OGG_OPUS
+#define CODEC_SNIFF_BYTES 4096  // give up looking for a frame after this
+#define SYNC_GIVE_UP 65536      // bytes dropped looking for whole frames before
+                                // the decoder is left to find its own way
+
+// stream connection phases
+// A station is opened by a non-blocking state machine stepped from the
+// audio task, so a dead host never holds up commands from the ui.
+#define CONN_IDLE 0             // no connection
+#define CONN_RESOLVING 1        // waiting on dns
+#define CONN_CONNECTING 2       // tcp connect in progress
+#define CONN_HANDSHAKE 3        // tls handshake in progress, https only
+#define CONN_HEADERS 4          // request sent, reading http headers
+#define CONN_PLAYLIST 5         // reading a pls/m3u body for the stream url
+#define CONN_BUFFERING 6        // filling the jitter buffer
+#define CONN_PLAYING 7          // feeding the decoder
+#define CONN_FAILED 8           // gave up, see conn_t.error
+#define CONN_RETRY 9            // lost a playing stream, waiting to reconnect
+
+// per phase timeouts in milliseconds
+#define CONN_RESOLVE_TIMEOUT 4000
+#define CONN_CONNECT_TIMEOUT 5000
+#define CONN_HANDSHAKE_TIMEOUT 8000
+#define CONN_HEADER_TIMEOUT 5000
+#define CONN_BUFFER_TIMEOUT 10000
+
+// dns lookups
+// lwip's dns is not thread safe with core locking off, so a lookup is run
+// in the tcpip thread through tcpip_callback(), as hostByName() does. A
+// query cannot be called off, so each one carries a generation number and
+// an answer only lands in the connection still waiting for that number.
+#define DNS_PENDING 0
+#define DNS_FOUND 1
+#define DNS_FAILED 2
+#define DNS_QUERIES (2 + WARM_POOL_SIZE)  // handed over, not yet started
+
+#define CONN_URL_SIZE 256       // longest url accepted
+#define CONN_HOST_SIZE 64       // longest host name accepted
+#define CONN_LINE_SIZE (CONN_URL_SIZE + 32) // header line buffer, fits a 
+                                // Location: with the longest url, longer lines are cut
+
+// redirects and playlists
+// 3xx answers and pls/m3u playlists are followed to the audio url, which
+// is then remembered for the station, so the next tune goes straight
+// there. A remembered url that fails is forgotten and the station url
+// is resolved again. The urls are kept in nvs too, so the first tune
+// after a boot skips the redirects as well. There is no wall clock, so a
+// url outlives RESOLVE_BOOTS boots or RESOLVE_TTL of one run, whichever
+// comes first.
+#define CONN_MAX_HOPS 5         // redirects plus playlists per tune
+#define CONN_PLAYLIST_MAX 8192  // playlist bytes read before giving up
+#define RESOLVE_SLOTS 8         // stations whose audio url is remembered
+#define RESOLVE_TTL 3600000UL   // ms a remembered url is trusted
+#define RESOLVE_BOOTS 8         // boots a remembered url is trusted
+#define RESOLVE_SAVE_DELAY 60000UL // ms between nvs writes of the urls
+#define RESOLVE_MAGIC 0x5245534c  // "RESL"
+
+// tls
+// https stations run mbedtls over the same non-blocking socket, the
+// core's mbedtls build does its aes and sha on the esp32 crypto hardware.
+// The session of each recent host is kept, so tuning back to a station
+// resumes it with a short handshake instead of a full key exchange.
+// Stream audio is public and the device carries no ca store, so the
+// server certificate is not verified unless TLS_VERIFY is set.
+#define TLS_SESSIONS 4          // hosts whose tls session is kept
+#define TLS_VERIFY false        // true to require a valid certificate chain
+
+// icy metadata
+// With ICY_METADATA set the server is asked to interleave metadata blocks
+// every icy-metaint audio bytes. Reads stop at each block boundary so the
+// audio bytes are never scanned, and only the block itself is parsed.
+#define ICY_METADATA true       // false to stream without metadata
+#define ICY_TITLE_SIZE 64       // StreamTitle buffer, longer titles are cut
+#define ICY_URL_SIZE 64         // StreamUrl buffer
+#define ICY_KEY_SIZE 16         // metadata key buffer
+#define ICY_CHUNK 64            // metadata bytes parsed per read
+
+// icy metadata parser states
+#define ICY_KEY 0               // reading a key up to '='
+#define ICY_OPEN 1              // expecting the opening quote
+#define ICY_VALUE 2             // reading a quoted value
+#define ICY_QUOTE 3             // saw a quote, value ends if ';' follows
+
+// warm connections
+// While the menu is open the highlighted station and its neighbours are
+// opened speculatively and the first few KB prebuffered, so selecting one
+// starts almost at once. The pool is sized to stay inside the ram budget.
+#define WARM_POOL_BUDGET 32768  // bytes of ram granted to warm connections
+#define WARM_PREBUFFER 4096     // audio bytes prebuffered per connection
+#define WARM_SOCKET_COST 5760   // lwip receive window held by an open socket
+#define WARM_SLOTS (WARM_POOL_BUDGET / (WARM_PREBUFFER + WARM_SOCKET_COST))
+#define WARM_POOL_SIZE (WARM_SLOTS < 3 ? WARM_SLOTS : 3) // item and item +-1
+
+// station health
+// Between copies the audio task opens one station at a time as far as its
+// audio headers and closes it again, noting the time that took, the http
+// status and the bitrate and codec the server gives. Results are kept by
+// url hash, so edits to the list do not shift them, and saved to nvs. The
+// menu marks stations that failed twice running. The playing station is
+// measured from its own connection instead. Probes wait while the stream
+// rebuffers or the menu holds warm connections, and https stations wait
+// for the player to stop, a tls context does not fit beside a stream.
+// GET /probes on WEB_PORT lists the table.
+#define PROBE_GAP_MS 15000      // between probes
+#define PROBE_AGE_MS 1800000UL  // results older than this are probed again
+#define PROBE_SLOTS 64          // stations remembered
+#define PROBE_DEAD_FAILS 2      // failures in a row that mark a station dead
+#define PROBE_DEAD_MARK "x "    // menu prefix of a dead station
+#define PROBE_SAVE_DELAY 600000UL // ms between nvs writes of the table
+#define PROBE_MAGIC 0x50524f42  // "PROB"
+
+// Stations
+// Names and urls are packed back to back in the table arena as
+// "name\0url\0" pairs, with the offset of each pair kept in an index. Both grow
+// with the content, so short entries cost only what they hold. The arena is
+// the real bound, a name of 20 and a url of 40 characters is about 60 bytes,
+// so it holds about 200 stations. The count cap is sized from the shortest
+// pair worth keeping, so it only stops a table of tiny entries.
+#define STATION_NAME_SIZE 50          // max length of a name (49 char + nul)
+#define STATION_ARENA_MAX 12288       // most bytes of names and urls, nvs
+                                      // partition (20K by default) must fit it
+#define STATION_MIN_SIZE 24           // bytes of the shortest useful pair
+#define STATION_MAX (STATION_ARENA_MAX / STATION_MIN_SIZE)  // most stations the index will hold
+#define STATION_GROW 512              // arena growth step in bytes
+#define STATION_INDEX_GROW 16         // index growth step in stations
 int currentIndex = 0;                 // stream pointer 
-char streamsX[TOTAL_ITEMS * STREAM_ITEM_SIZE]; // names & urls of stations
+
+// Station table
+// The whole table is stored in prefs as one blob, read with a single
+// getBytes() at boot. The header carries a version and a checksum so a
+// stale or damaged blob is detected and rebuilt. Only the used part of
+// the arena is stored, the index is rebuilt from it on load.
+#define STATION_MAGIC 0x41455354      // "AEST"
+#define STATION_VERSION 2             // bump when the item layout changes
+struct stationTable_t {
+  uint32_t magic;                     // STATION_MAGIC
+  uint16_t version;                   // STATION_VERSION
+  uint16_t count;                     // stations when stored
+  uint32_t crc;                       // crc32 of items
+  uint32_t size;                      // bytes of items in use
+  char items[];                       // packed name/url pairs
+};
+
+// Station sets
+// A set is a table with its index. The live set is published through a
+// single pointer: an edit is built in the spare set and swapped in whole,
+// so the other tasks see either the old stations or the new ones. They
+// use what they read at once (names are drawn, urls copied) and the spare
+// is not rebuilt before the next edit, so nothing changes under them.
+struct stationSet_t {
+  stationTable_t* table;              // header followed by the arena
+  size_t cap;                         // bytes allocated for items
+  uint16_t* index;                    // arena offset of each station
+  int indexCap;                       // stations the index has room for
+  int count;                          // stations in the table
+};
+stationSet_t stationSets[2];          // live and spare
+stationSet_t* volatile stationLive = &stationSets[0];
+SemaphoreHandle_t stationLock = NULL; // held while a set is built or stored
+volatile bool stationsDirty = false;  // live set not yet in prefs
+
+// Version 1 of the blob held 36 fixed width items,
+// each a 50 byte name followed by a 50 byte url
+#define LEGACY_ITEMS 36               // stations in the old layouts
+#define LEGACY_ITEM_SIZE 100          // line item width
+#define LEGACY_ELEMENT_SIZE 50        // max length of name, url (49 char + nul)
+struct stationTableV1_t {
+  uint32_t magic;
+  uint16_t version;                   // 1
+  uint16_t count;                     // LEGACY_ITEMS
+  uint32_t crc;                       // crc32 of items
+  char items[LEGACY_ITEMS * LEGACY_ITEM_SIZE];
+};
 
 // Preferences database
 #define PREF_RO true                  // pref read-only
@@ -85,7 +671,48 @@ const char* portalName = "AetherStreamer"; // portal ssid
 const char* settings = "settings";    // general purpose namespace in prefs
 const char* listened = "listened";    // settings key of last listened to stream
 const char* audiovol = "volume";      // settings key of audio level
+const char* profileKey = "profile";   // settings key of the output profile
+const char* roomKey = "room";         // settings key of the multi-room role
 const char* initPref = "initPref";    // key for initilization
+const char* stations = "stations";    // station table namespace in prefs
+const char* tableKey = "table";       // key of the station table blob
+const char* wifiPrefs = "wifi";       // wifi fast connect namespace in prefs
+const char* cacheKey = "cache";       // key of the wifi cache blob
+const char* probePrefs = "probes";    // station health namespace in prefs
+const char* resolvePrefs = "resolve"; // remembered audio urls namespace in prefs
+
+// last good wifi connection
+struct wifiCache_t {
+  uint32_t magic;                     // WIFI_CACHE_MAGIC
+  uint8_t bssid[6];                   // access point
+  uint8_t channel;                    // its channel
+  uint8_t leaseBoots;                 // boots on the cached lease so far
+  uint32_t ip;                        // dhcp lease, 0 when not cached
+  uint32_t gateway;
+  uint32_t mask;
+  uint32_t dns;
+  uint32_t crc;                       // crc32 of the bytes above
+};
+uint8_t wifiLeaseBoots = 0;           // this boot's count, 0 after dhcp
+
+// boot timeline, esp_timer us, which starts after the bootloader
+int64_t bootStartUs = 0;              // 0, or when the last power down woke
+int64_t bootWifiUs = 0;               // wifi joined
+int64_t bootConnUs = 0;               // first stream reached its body
+int64_t bootPcmUs = 0;                // first pcm went out
+
+// Settings cache
+// The settings namespace is read once at boot and served from ram.
+// Changes are written back after SETTINGS_FLUSH_DELAY without further
+// changes, and always before power down, so the loop never waits on flash.
+#define SETTINGS_FLUSH_DELAY 10000     // ms of quiet before writing nvs
+const char* settingKeys[] = {          // keys held in the cache
+  listened, audiovol, profileKey, roomKey
+};
+#define SETTINGS_COUNT (sizeof(settingKeys) / sizeof(settingKeys[0]))
+int settingValue[SETTINGS_COUNT];      // cached values
+bool settingDirty[SETTINGS_COUNT];     // changed since the last flush
+bool settingsPending = false;          // any dirty entry
 
 // user control I/O
 #define ROTARY_ENCODER_A_PIN 33       // clk
@@ -93,30 +720,380 @@ const char* initPref = "initPref";    // key for initilization
 #define ROTARY_ENCODER_BUTTON_PIN 34  // sw
 #define ROTARY_ENCODER_STEPS 2        // 1, 2 or 4
 
-AiEsp32RotaryEncoder rotaryEncoder = AiEsp32RotaryEncoder(
-    ROTARY_ENCODER_A_PIN,             // ky040 clk
-    ROTARY_ENCODER_B_PIN,             //   "   dt
-    ROTARY_ENCODER_BUTTON_PIN,        //   "   sw
-    -1,                               // Vcc pin -1 = not used
-    ROTARY_ENCODER_STEPS         
-);
+// input events, from the encoder isrs to loop()
+// The knob and button are decoded in their isrs into timestamped events on
+// a ring, so a loop() held up by a connect, a flash write or the portal
+// still sees every detent and click, in order and with the time it
+// happened. All gpio isrs run from the one interrupt, one after another,
+// so there is a single producer and a single consumer and no lock.
+#define INPUT_QUEUE 32                // events held, a power of two
+#define INPUT_DEBOUNCE_MS 30          // button contact bounce ignored
+#define INPUT_ACCEL_MS 25             // detents closer than this step faster
+#define INPUT_ACCEL_MAX 10            // largest volume step of a fast turn
+#define INPUT_LONG_MS 800             // a press held this long pauses
+#define INPUT_DOUBLE_MS 3000          // a press this soon after the last is a double
+#define INPUT_TURN 1                  // knob moved one detent
+#define INPUT_PRESS 2                 // button went down
+#define INPUT_RELEASE 3               // button came up
+#define INPUT_DOUBLE 4                // follows the press that made a double click
+struct input_t {
+  uint32_t ms;                        // millis() when it happened
+  int8_t type;                        // INPUT_xxx
+  int8_t delta;                       // turn direction, +1 is volume up
+};
+input_t inputQueue[INPUT_QUEUE];      // the ring
+volatile uint32_t inputHead = 0;      // next slot written, isr only
+volatile uint32_t inputTail = 0;      // next slot read, loop() only
+volatile uint32_t inputLost = 0;      // events dropped on a full ring
+uint8_t inputAB = 0;                  // last two quadrature states
+int8_t inputSteps = 0;                // transitions toward the next detent
+bool inputDown = false;               // debounced button state
+uint32_t inputButtonMs = 0;           // millis() of its last change
+uint32_t inputLastPress = 0;          // millis() of the last press, isr
+uint32_t inputTurnMs = 0;             // millis() of the last detent, loop()
+uint32_t inputPressMs = 0;            // millis() of the press, loop()
+bool inputPressed = false;            // a press waits for its release
+bool inputTwice = false;              // and is the second of a double click
+
+// Q15 volume stage between the decoder and i2s
+class GainStage : public AudioStream {
+  public:
+    GainStage(AudioStream& out) : p_out(&out) {}
+    void setOutput(AudioStream& out) { p_out = &out; }
+    bool begin(void) override;
+    void setVolume(int level);          // 0..100 on the log curve
+    void setAudioInfo(AudioInfo cfg) override;
+    int availableForWrite(void) override { return p_out->availableForWrite(); }
+    size_t write(const uint8_t* data, size_t len) override;
+    void setDmaFrames(uint32_t frames) { dmaFrames = frames; }
+    void idle(void) {                   // output paused on purpose, not an underrun
+      lastOut = 0; 
+      resampleReset(&stretch);          // nothing to join the next block to
+    }
+    void setDrift(int32_t ppm) { drift = ppm; }  // > 0 plays faster
+    int64_t heardUs(void);              // when the next frame written is heard
+    volatile uint32_t blocks = 0;       // pcm blocks written, one per decoded frame
+    volatile uint32_t frames = 0;       // pcm frames written
+    volatile uint32_t outUs = 0;        // time spent waiting on i2s
+  protected:
+    uint32_t dmaFrames = 0;             // frames the i2s dma holds
+    int64_t lastOut = 0;                // esp_timer time the last block went out
+    AudioStream* p_out;
+    int32_t gain = 0;                   // Q15 reached at the end of the last block
+    int32_t target = 0;                 // Q15 requested by setVolume()
+    volatile int32_t drift = 0;         // resampling ratio, ppm
+    int64_t clockUs = 0;                // esp_timer time the dma started from empty
+    uint32_t clockFrames = 0;           // frames written since
+    resample_t stretch;                 // resampler state between blocks
+    int16_t stretchBuf[RESAMPLE_CHANNELS * RESAMPLE_ROOM(RESAMPLE_BLOCK)];
+    void apply(int16_t* pcm, size_t frames, int ch);
+    void output(const uint8_t* data, size_t len);
+};
+int32_t gainCurve[VOLUME_LEVELS];     // Q15 gain of each knob position
+uint32_t decodeCarryUs = 0;           // decode time not yet spread over frames
+
+// output profile marks, audio in ms
+struct profile_t {
+  const char* name;
+  int dmaMs;                          // held by the i2s dma
+  int prefillMs;                      // buffered before playback starts
+  int lowMs;                          // rebuffer when fill drops under this
+};
+const profile_t profiles[PROFILE_COUNT] = {
+  { "auto", 0, 0, 0 },                // never active, resolves to one below
+  { "low", 20, 400, 60 },
+  { "robust", 150, JITTER_PREFILL_MS, JITTER_LOW_MS },
+};
+volatile int outputProfile = PROFILE_AUTO; // selected, kept in settings
+volatile int profileActive = PROFILE_LOW;  // in use, PROFILE_LOW or _ROBUST
+uint32_t profileRebuffers = 0;        // statRebuffers when it was chosen
+uint32_t profileUnderruns = 0;        // statUnderruns when it was chosen
+int jitterKbps = JITTER_DEFAULT_KBPS; // bitrate the jitter marks are set for
+
+// drift controller, audio task only
+unsigned long driftAt = 0;            // millis() of the last step
+unsigned long driftPlaying = 0;       // ms played since the stream (re)started
+float driftFill = 0;                  // smoothed fill, ms of audio
+float driftTarget = -1;               // set point, ms, < 0 until settled
+float driftSum = 0;                   // integral term, ppm
+volatile int driftPpm = 0;            // ratio in use, for the stats
+
+// one multi-room datagram
+struct roomPacket_t {
+  int64_t sendUs;                     // leader esp_timer when sent
+  int64_t playUs;                     // leader esp_timer when the chunk is heard
+  uint32_t magic;                     // ROOM_MAGIC
+  uint32_t seq;                       // counts every packet sent
+  uint16_t epoch;                     // bumped on every station change
+  uint16_t len;                       // bytes of data used
+  uint8_t codec;                      // CODEC_xxx of the stream
+  uint8_t pad[3];
+  uint8_t data[JITTER_CHUNK];         // stream bytes, as fed to the decoder
+};
+#define ROOM_HEADER offsetof(roomPacket_t, data)
+
+// a chunk a follower holds in the jitter buffer
+struct roomMark_t {
+  int64_t playUs;                     // leader clock
+  uint16_t len;
+};
 
-void IRAM_ATTR readEncoderISR() {     // interrupt service routine
-    rotaryEncoder.readEncoder_ISR();
-}
+// multi-room, roomRole is set by loop(), the rest is audio task only
+const char* roomNames[ROOM_COUNT] = { "solo", "leader", "follower" };
+volatile int roomRole = ROOM_SOLO;    // selected, kept in settings
+int roomMode = ROOM_SOLO;             // role of the stream playing
+int roomSock = -1;                    // udp socket
+struct sockaddr_in roomAddr;          // the group
+roomPacket_t roomPacket;              // send and receive buffer
+uint32_t roomSeq = 0;                 // leader next, follower expected
+uint16_t roomEpoch = 0;               // leader current, follower playing
+bool roomJoined = false;              // follower has heard from the leader
+roomMark_t roomMarks[ROOM_MARKS];     // follower chunks, oldest first
+int roomMarkHead = 0;
+int roomMarkCount = 0;
+int64_t roomOffset = 0;               // local minus leader clock, plus least delay
+int64_t roomOffsetLast = INT64_MAX;   // least delay over the last window
+int64_t roomOffsetNext = INT64_MAX;   // and over this one so far
+int roomOffsetCount = 0;              // packets in this window
+bool roomRunning = false;             // follower is on the timeline
+float roomErr = 0;                    // smoothed timeline error, ms
+float roomSum = 0;                    // integral term, ppm
+volatile uint32_t roomLost = 0;       // packets that never came
+volatile uint32_t roomDropped = 0;    // chunks not played, no room or too late
+volatile uint32_t roomResyncs = 0;    // times a follower started over
+volatile int roomErrUs = 0;           // last timeline error, for the stats
+
+// histogram, log2 bins (0, 1, 2-3, 4-7 ...) unless filled by bin number
+struct hist_t {
+  uint32_t bins[STATS_BINS];
+  uint32_t count;                     // samples
+  uint32_t max;                       // largest sample
+  uint64_t sum;                       // for the mean
+};
+hist_t statNetRate;                   // stream bytes per second
+hist_t statFill;                      // jitter buffer fill, tenths
+hist_t statDecode;                    // decode time per frame, us
+hist_t statLoop;                      // loop() busy time per pass, us
+volatile uint32_t statNetBytes = 0;   // stream bytes since boot
+volatile uint32_t statRebuffers = 0;  // jitter buffer ran dry
+volatile uint32_t statUnderruns = 0;  // i2s dma ran dry while playing
+uint32_t statNetSecond = 0;           // bytes in the second being counted
+unsigned long statNetStart = 0;       // millis() when that second began
+unsigned long loopStart = 0;          // micros() at the top of loop()
+#if REPLAY_CAPTURES
+NullStream replaySink;                // takes the pcm as fast as it comes
+#endif
 
 // Instatiate the objects
-URLStream urlstream;                  // Use ICYStream if metadata is desired
-//ICYStream urlstream;                // Use URLStream when metadata is not needed
+// The audio objects below belong to the audio task once it is started,
+// loop() must only talk to them through audioSend()
 I2SStream i2s;
-VolumeStream volume(i2s);
-EncodedAudioStream mp3decode(&volume, new MP3DecoderHelix()); // Decoder stream
-StreamCopy copier(mp3decode, urlstream); // copy urlstream to decoder
+GainStage volume(i2s);
+MP3DecoderHelix mp3helix;             // mp3 codec, also reports the bitrate
+AACDecoderHelix aachelix;             // aac codec, also reports the bitrate
+#if OGG_VORBIS
+VorbisDecoder vorbis;
+#endif
+#if OGG_OPUS
+OpusOggDecoder opus;
+#endif
+EncodedAudioStream audioDecode(&volume, &mp3helix); // Decoder stream
+int audioCodec = CODEC_UNKNOWN;       // CODEC_xxx of the begun decoder
+
+// audio task interface
+struct audioCmd_t {
+  int cmd;                            // AUDIO_CMD_xxx
+  long arg;                           // command argument
+};
+QueueHandle_t audioQueue;             // ui -> audio task commands
+TaskHandle_t audioTaskHandle;
+TaskHandle_t loopTaskHandle = NULL;   // woken by the audio task on news
+loopTimer_t loopTimers[TIMER_COUNT];  // TIMER_xxx deadlines of loop()
+volatile bool portalSwitch = false;   // pin is low, kept by portalSwitchISR()
+esp_pm_lock_handle_t pmDecodeLock = NULL;  // full clock while decoding
+bool outputOn = true;                 // i2s dma running
+I2SConfig outputConfig;               // last configuration handed to i2s
+volatile bool audioActive = false;    // true while the task is streaming
+volatile int audioState = CONN_IDLE;  // connection phase of the stream
+const char* volatile audioError = ""; // reason for the last CONN_FAILED
+volatile uint32_t streamStalls = 0;   // stalls detected since boot
+volatile uint32_t streamReconnects = 0; // reconnects made since boot
+
+// sliding window of stream bytes, audio task only
+uint32_t rateBytes[RATE_BUCKETS];     // bytes received in each bucket
+bool rateFull[RATE_BUCKETS];          // jitter buffer was full in the bucket
+int rateIndex;                        // bucket being filled
+int rateFilled;                       // buckets that have been through a full width
+unsigned long rateStart;              // millis() when the current bucket began
+
+// stream connection
+struct conn_t {
+  int state;                          // CONN_xxx phase
+  unsigned long phaseStart;           // millis() when the phase was entered
+  const char* error;                  // failure reason
+  char url[CONN_URL_SIZE];            // copy of the station url
+  char host[CONN_HOST_SIZE];          // host part of url
+  const char* path;                   // points into url
+  uint16_t port;                      // tcp port, 80 by default
+  ip_addr_t addr;                     // resolved address
+  volatile int dnsState;              // DNS_xxx, set from the lwip thread
+  volatile uint32_t dnsGen;           // the lookup it waits for, 0 for none
+  int sock;                           // socket descriptor, -1 when closed
+  bool secure;                        // https, sock is wrapped in tls
+  mbedtls_ssl_context* tls;           // allocated for the handshake, else NULL
+  unsigned long tlsStart;             // millis() when the handshake began
+  uint32_t tlsHeapStart;              // free heap before the handshake
+  uint32_t tlsHeapLow;                // least free heap seen during it
+  bool tlsResume;                     // a cached session was offered
+  char line[CONN_LINE_SIZE];          // header line being read
+  int lineLen;                        // characters held in line
+  int status;                         // http status code
+  char origin[CONN_URL_SIZE];         // station url the connection was opened for
+  uint32_t originHash;                // crc32 of origin, resolve cache key
+  int hops;                           // redirects and playlists followed
+  bool viaCache;                      // url came from the resolve cache
+  bool playlist;                      // body is a playlist, not audio
+  int bodyLen;                        // playlist bytes read so far
+  int codec;                          // CODEC_xxx of the body
+  int kbps;                           // icy-br, 0 when not given
+  int metaInt;                        // audio bytes between metadata, 0 = none
+  int metaCount;                      // audio bytes left before the next block
+  int metaLeft;                       // block bytes left, -1 = length byte next
+  int icyState;                       // ICY_xxx parser state
+  char icyKey[ICY_KEY_SIZE];          // key being read
+  int icyKeyLen;
+  char* icyDest;                      // value destination, NULL to skip
+  int icyDestSize;
+  int icyLen;                         // characters held in icyDest
+  char icyTitle[ICY_TITLE_SIZE];      // StreamTitle being parsed
+  char icyUrl[ICY_URL_SIZE];          // StreamUrl being parsed
+  char title[ICY_TITLE_SIZE];         // last complete StreamTitle
+  char titleUrl[ICY_URL_SIZE];        // last complete StreamUrl
+  uint32_t titleSeq;                  // bumped when title changes
+};
+conn_t audioConn;                     // the stream being played
+
+// tls sessions kept for resumption, shared config for every connection
+struct tlsSession_t {
+  char host[CONN_HOST_SIZE];          // "" when the slot is free
+  mbedtls_ssl_session session;
+  unsigned long used;                 // millis() of last use, oldest goes
+};
+// audio urls found behind redirects and playlists
+struct resolved_t {
+  uint32_t hash;                      // crc32 of the station url, 0 = free
+  unsigned long stored;               // millis() when it was resolved
+  unsigned long used;                 // millis() of last use, oldest goes
+  uint8_t boots;                      // boots since it was resolved
+  char url[CONN_URL_SIZE];            // where the audio actually is
+};
+resolved_t resolveCache[RESOLVE_SLOTS];
+volatile bool resolveDirty = false;   // urls not yet in nvs
+unsigned long resolveSaved = 0;       // millis() of the last write
+
+tlsSession_t tlsSessions[TLS_SESSIONS];
+mbedtls_ssl_config tlsConf;
+bool tlsReady = false;                // tlsConf has been set up
+
+// speculative connections, only touched by the audio task
+struct warm_t {
+  conn_t conn;                        // speculative connection
+  int index;                          // station index, -1 when free
+  size_t len;                         // bytes prebuffered
+  uint8_t buf[WARM_PREBUFFER];        // first audio bytes of the stream
+};
+warm_t warmPool[WARM_POOL_SIZE];
+
+// station health, one entry per url, written by the audio task
+struct probe_t {
+  uint32_t hash;                      // crc32 of the url, 0 when free
+  uint32_t at;                        // millis() of the result, 0 = before this boot
+  uint16_t connectMs;                 // open to audio headers
+  int16_t status;                     // http status, 0 when none came
+  uint16_t kbps;                      // advertised bitrate
+  uint8_t codec;                      // CODEC_xxx from the content type
+  uint8_t fails;                      // failures in a row
+};
+struct probeStore_t {                 // nvs image of the table
+  uint32_t magic;                     // PROBE_MAGIC
+  probe_t slots[PROBE_SLOTS];
+  uint32_t crc;                       // crc32 of the bytes above
+};
+struct probesPage_t {                 // GET /probes being sent
+  int station;                        // next to render, -1 is the head
+  size_t len;                         // bytes in line
+  size_t sent;                        // of those, already sent
+  char line[160];                     // the station being sent
+};
+probe_t probes[PROBE_SLOTS];
+volatile bool probesDirty = false;    // results not yet in nvs
+unsigned long probesSaved = 0;        // millis() of the last write
+conn_t probeConn;                     // the probe in flight, audio task only
+
+// lookup waiting for the tcpip thread to start it
+struct dnsQuery_t {
+  volatile bool busy;                 // handed over, the thread has not run it
+  uint32_t gen;                       // conn_t.dnsGen of the asker
+  char host[CONN_HOST_SIZE];          // copied, lwip keeps its own once started
+};
+dnsQuery_t dnsQueries[DNS_QUERIES];
+uint32_t dnsGenNext = 0;              // last generation given, audio task only
+portMUX_TYPE dnsMux = portMUX_INITIALIZER_UNLOCKED;  // dnsGen vs the answer
+int probeIndex = -1;                  // station being probed, -1 when none
+int probeNext = 0;                    // where the round carries on
+unsigned long probeAt = 0;            // millis() the last probe began
+
+// now playing, written by the audio task, shown by loop()
+char nowTitle[ICY_TITLE_SIZE];
+volatile uint32_t nowTitleSeq = 0;    // bumped on each change
+portMUX_TYPE nowTitleMux = portMUX_INITIALIZER_UNLOCKED;
+
+// jitter buffer, only touched by the audio task
+uint8_t* jitterBuf;                   // ring storage
+size_t jitterSize;                    // ring capacity in bytes
+size_t jitterHead = 0;                // write position
+size_t jitterTail = 0;                // read position
+volatile size_t jitterCount = 0;      // bytes held in the ring
+size_t jitterPrefill;                 // start watermark in bytes
+size_t jitterLow;                     // rebuffer watermark in bytes
+volatile bool jitterBuffering = true; // waiting for the prefill mark
+#if HEAP_GUARD
+TaskHandle_t volatile heapGuardTask = NULL; // task that may not allocate now
+#endif
+
+// time shift, loop() opens and closes it, the audio task runs it
+const char* shiftNames[] = {"live", "paused", "behind"};
+volatile int shiftState = SHIFT_LIVE; // SHIFT_xxx, set by the audio task
+volatile bool shiftDone = false;      // the audio task is finished with it
+uint8_t* shiftPages = NULL;           // two pages the audio task fills, and
+                                      // one loop() reads back into
+int shiftPage = 0;                    // page being filled, audio task
+size_t shiftFill = 0;                 // bytes in it
+volatile int shiftReady = -1;         // full page handed to loop(), -1 none
+volatile size_t shiftAsk = 0;         // bytes the audio task wants back, 0
+                                      // once loop() has answered
+volatile size_t shiftGot = 0;         // bytes loop() read back
+bool shiftAsked = false;              // an answer is due, audio task
+uint8_t* shiftRam = NULL;             // psram store, NULL for the file
+File shiftFile;                       // LittleFS store
+size_t shiftCapacity = 0;             // store bytes, whole pages
+uint64_t shiftWritten = 0;            // bytes stored since the pause, loop()
+uint64_t shiftRead = 0;               // bytes read back, loop()
+volatile uint32_t shiftBehind = 0;    // bytes stored and not yet played
+volatile uint32_t shiftLost = 0;      // bytes overwritten before playing
 SSD1306AsciiWire oled;
+char oledModel[OLED_ROWS][OLED_COLS + 1]; // what the panel shows, space padded
+bool oledInvert[OLED_ROWS];           // row shown inverted
+bool oledModelValid = false;          // false after a direct print to oled
+int rssiValue;                        // cached wifi signal
+unsigned long rssiTime;               // millis() of the last reading
+bool rssiRead = false;                // rssiValue holds a reading
 Preferences prefs;                    // persistent data store
 WiFiManager wifiMan;                  // instatiate a wifi object
 
-char stream_item[TOTAL_ITEMS][2] = {  // prefs stream item names
+// Before the station blob each item had its own namespace, these names
+// are only used to migrate such prefs
+char stream_item[LEGACY_ITEMS][2] = {  // prefs stream item names
   "0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "A", "B", 
   "C", "D", "E", "F", "G", "H", "I", "J", "K", "L", "M", "N", 
   "O", "P", "Q", "R", "S", "T", "U", "V", "W", "X", "Y", "Z"
@@ -125,44 +1102,70 @@ char stream_type[2][4] = {"tag", "url"}; // prefs key names
 #define TYPE_TAG 0                    // prefs type references
 #define TYPE_URL 1  
 
-// Must have enough unique element names for TOTAL_ITEMS
-const char* tagElement[] = {          // portal html element tags
-  "t0",  "t1",  "t2",  "t3",  "t4", 
-  "t5",  "t6",  "t7",  "t8",  "t9", 
-  "t10", "t11", "t12", "t13", "t14", 
-  "t15", "t16", "t17", "t18", "t19",
-  "t20", "t21", "t22", "t23", "t24",
-  "t25", "t26", "t27", "t28", "t29", 
-  "t30", "t31", "t32", "t33", "t34", 
-  "t35", "t36"
-};
-const char* nameElement[] = {         // portal html tag field titles
-  "Name 1",  "Name 2",  "Name 3",  "Name 4",  "Name 5",  
-  "Name 6",  "Name 7",  "Name 8",  "Name 9",  "Name 10", 
-  "Name 11", "Name 12", "Name 13", "Name 14", "Name 15", 
-  "Name 16", "Name 17", "Name 18", "Name 19", "Name 20", 
-  "Name 21", "Name 22", "Name 23", "Name 24", "Name 25",
-  "Name 26", "Name 27", "Name 28", "Name 29", "Name 30",  
-  "Name 31", "Name 32", "Name 33", "Name 34", "Name 35", 
-  "Name 36"
-};
-const char* urlElement[] = {          // portal url element tags/titles
-  "URL_1",  "URL_2",  "URL_3",  "URL_4",  "URL_5",  
-  "URL_6",  "URL_7",  "URL_8",  "URL_9",  "URL_10", 
-  "URL_11", "URL_12", "URL_13", "URL_14", "URL_15", 
-  "URL_16", "URL_17", "URL_18", "URL_19", "URL_20", 
-  "URL_21", "URL_22", "URL_23", "URL_24", "URL_25",
-  "URL_26", "URL_27", "URL_28", "URL_29", "URL_30",  
-  "URL_31", "URL_32", "URL_33", "URL_34", "URL_35", 
-  "URL_36"
-};
-
 // globals
 long volLevel; // audio volume level
 
-// portal elements
-WiFiManagerParameter* tagElementParam[TOTAL_ITEMS]; // Arrays to store pointers to tag objects
-WiFiManagerParameter* urlElementParam[TOTAL_ITEMS]; // and url objects
+// web server and portal elements
+// One async server answers /stats and /probes at all times, and the
+// control, station and firmware update pages while the portal switch is
+// on, so changing the unit takes a hand on it. A change is a POST, a GET
+// of a control page only reads. Its task runs on the
+// loop core below the audio task (see build_flags), so loading or saving
+// a page never holds up audio. A control request that changes state is
+// queued for loop() to apply, the way the serial commands are. Each load
+// of the station page shows every station plus a few blank slots for new
+// entries.
+// The page is rendered a slot at a time into a chunked response, and a
+// save is parsed as it arrives straight into the spare station set, so
+// the portal needs the same few KB however many stations there are.
+#define WEB_PORT 80                   // stats, control, station and update pages
+#define WEB_QUEUE_LEN 4               // control requests waiting for loop()
+#define WEB_PROFILE 1                 // webCmd_t.cmd, arg is the profile
+#define WEB_ROOM 2                    // arg is the role
+#define WEB_SHIFT 3                   // arg is a SHIFT_OP_xxx
+#define PORTAL_SPARE 4                // blank name/url slots on the page
+#define PORTAL_LOCK_WAIT 2000         // ms a save waits for a store to end
+#define PORTAL_LINE_SIZE 2048         // one slot of the page, escaped
+#define PORTAL_KEY_SIZE 8             // "u499" and room to spare
+#define PORTAL_BUILD_TIMEOUT 10000    // ms before a stalled save is dropped
+#define PORTAL_FORM_TYPE "application/x-aether-stations"  // save body type
+AsyncWebServer webServer(WEB_PORT);
+
+// control request, web server task -> loop()
+struct webCmd_t {
+  int cmd;                            // WEB_xxx
+  int arg;
+};
+QueueHandle_t webQueue;
+
+// station page being sent
+struct portalPage_t {
+  int slot;                           // next to render, -1 is the head
+  int slots;                          // station slots on the page
+  size_t len;                         // bytes in line
+  size_t sent;                        // of those, already sent
+  char line[PORTAL_LINE_SIZE];        // the part being sent
+};
+
+// station form being received, urlencoded "t0=name&u0=url&t1=..."
+struct portalForm_t {
+  uint32_t build;                     // portalBuild this save owns
+  char key[PORTAL_KEY_SIZE];          // field name
+  uint8_t keyLen;
+  bool inValue;                       // past the '='
+  uint8_t pct;                        // hex digits seen of a %XX escape
+  uint8_t hex;                        // its value so far
+  char value[CONN_URL_SIZE];          // field value, cut to fit
+  uint16_t valueLen;
+  char tag[STATION_NAME_SIZE];        // a name waiting for its url
+  int tagSlot;                        // its slot, -1 for none
+  int fields;                         // fields seen
+  const char* full;                   // why the rest was dropped, NULL while there is room
+};
+uint32_t portalBuild = 0;             // bumped by each save into the spare
+unsigned long portalBuildStart = 0;   // millis() it began, 0 when none
+volatile bool portalSaved = false;    // the server swapped in an edit
+volatile bool portalRestart = false;  // new firmware, reboot from loop()
 
 
 /*
@@ -176,15 +1179,21 @@ void setup() {
   pinMode(STREAM_PIN, INPUT_PULLUP);  // load default streams
   pinMode(NVS_CLR_PIN, INPUT_PULLUP); // clear non-volatile memory
 
+  stationLock = xSemaphoreCreateMutex();
+
   // Message port
   Serial.begin(115200);
+  Serial.onReceive(loopWake);  // a command wakes loop() instead of a poll
+  pmBegin();  // clock the cpu down whenever it can
   Serial.println(F("Aether Streamer"));
   Serial.print(F("Steven R Stuart,  "));
   Serial.print(F(__DATE__));
   Serial.print(F(" "));
   Serial.println(F(__TIME__));
+  char ver[VERSION_SIZE];
+  version(ver, sizeof(ver));
   Serial.print(F("ver "));
-  Serial.println(version());
+  Serial.println(ver);
   
   // OLED display device
   Wire.begin(SDA_PIN, SCL_PIN);  // start i2c interface
@@ -194,13 +1203,17 @@ void setup() {
   //oled.setFont(lcd5x7);
   
   if (digitalRead(NVS_CLR_PIN) == LOW) wipeNVS(); // user request to clear memory
+  settingsLoad();          // cache the general settings
 
   if (digitalRead(STREAM_PIN) == LOW) 
     initializeStreams();   // user request to load default streams
-  populateStreams();       // fill streamsX array from prefs 
+  populateStreams();       // fill the station table from prefs 
+  probesLoad();            // station health from the last run
+  resolveLoad();           // and the audio urls behind redirects
 
   // Reload the default streams if desired
   currentIndex = settingGet(listened);  // get index of previous listened stream
+  if (currentIndex >= stationLive->count) currentIndex = 0;  // table has shrunk
 
   // Configure Wifi system
   wifiPortalMessage();
@@ -211,9 +1224,15 @@ void setup() {
     wifiPortalMessage();
     wifiMan.startConfigPortal(portalName); 
   }
+  else if (wifiFastConnect()) {
+    oledClear();  // straight back onto the last access point
+  }
   else {
     // Tries to connect to the last known network. Launches a
     // captive portal if the connection fails or the timeout is reached.
+    IPAddress ip, gateway, mask, dns;
+    if (wifiStatic(&ip, &gateway, &mask, &dns))
+      wifiMan.setSTAStaticIPConfig(ip, gateway, mask, dns);
     if(wifiMan.autoConnect(portalName)) {   
         // Retrieve the current Wi-Fi configuration
         wifi_config_t conf;
@@ -226,49 +1245,63 @@ void setup() {
         } 
         else {
           Serial.println(F("Failed to get WiFi config"));
-          oled.clear();
+          oledClear();
           oled.print(F("CONFIG FAIL\nWiFi Error\n"));
         }
-        oled.clear();
+        oledClear();
     } 
     else {
       Serial.println(F("Failed to connect to WiFi."));
-      oled.clear();
+      oledClear();
       oled.print(F("CONNECT FAIL\nWiFi Error\nRestarting..."));
       delay(OLED_TIMER);
       esp_restart();
     }
   }
+  bootWifiUs = esp_timer_get_time();
+  if (WiFi.status() == WL_CONNECTED) wifiCacheSave();  // for the next boot
 
-  oled.clear();
+  oledClear();
   oled.print(F("Aether Streamer\nSteven R Stuart\nW8AN"));
   //oled.print(version());
 
   // Keyes KY-040
-  rotaryEncoder.begin();
-  rotaryEncoder.setup(readEncoderISR);
-  rotaryEncoder.setBoundaries(0, 100, false); // minValue, maxValue, circular
-  rotaryEncoder.setEncoderValue(100-settingGet(audiovol));   // initial volume 
-  rotaryEncoder.setAcceleration(25);
-  //rotaryEncoder.disableAcceleration();
+  inputBegin();
+
+  // The portal switch waits on a level like the encoder button does
+  portalSwitch = digitalRead(PORTAL_PIN) == LOW;
+  attachInterrupt(digitalPinToInterrupt(PORTAL_PIN), portalSwitchISR,
+                  portalSwitch ? ONHIGH : ONLOW);
+  runSleepTimer(true);  // the power on timer, see the top of the file
 
   // Audio system error messages (Debug, Info, Warning, Error)
   AudioLogger::instance().begin(Serial, AudioLogger::Warning);   
 
-  // Output stream configuration
-  auto config = i2s.defaultConfig(TX_MODE);
-  config.pin_bck = 26;  // BCLK  -max98357 pins
-  config.pin_ws  = 25;  // LRC
-  config.pin_data = 22; // DIN
-  i2s.begin(config);
+  // Output stream configuration, the dma depth follows the profile
+  outputProfile = constrain(settingGet(profileKey), 0, PROFILE_COUNT-1);
+  roomRole = constrain(settingGet(roomKey), 0, ROOM_COUNT-1);
+  profileActive = (outputProfile == PROFILE_ROBUST) ? PROFILE_ROBUST : PROFILE_LOW;
+  outputConfigure(AudioInfo());
 
-  // Set up i2s based on sampling rate provided by decoder
-  mp3decode.begin();
+  // The decoder is begun by the audio task once the stream format is known,
+  // it then sets up i2s again from the sampling rate of the stream
 
   // Volume control
-  volume.begin(config);   // config provides the bits_per_sample and channels
+  volume.begin();                      // build the gain curve
   volLevel = settingGet(audiovol);     // get the saved volume level
-  volume.setVolume(volLevel / 100.0);  // set that volume
+  volume.setVolume(volLevel);          // set that volume
+
+  // Ring buffer between the network and the decoder
+  jitterBegin();
+
+  // Statistics, control and station pages
+  webBegin();
+
+  // Hand the audio pipeline over to its own task
+  loopTaskHandle = xTaskGetCurrentTaskHandle();
+  audioQueue = xQueueCreate(AUDIO_QUEUE_LEN, sizeof(audioCmd_t));
+  xTaskCreatePinnedToCore(audioTask, "audio", AUDIO_TASK_STACK, NULL,
+                          AUDIO_TASK_PRIORITY, &audioTaskHandle, AUDIO_TASK_CORE);
 }
 
 
@@ -278,16 +1311,15 @@ void setup() {
 
 // oled screen status and blanking timing
 bool displayOn = true;
-unsigned long oledStartTime; 
-unsigned long oledCurrentTime = 0;   
 
 // stream status
 bool systemStreaming = false;
+int streamState = CONN_IDLE;         // last connection phase seen by loop
+uint32_t titleSeq = 0;               // last stream title shown
 
 // menu vars
 bool menuOpen = false;
 int menuIndex = currentIndex;
-long volumePos;
 
 // sleep timer status and timing
 bool systemSleeping = false;
@@ -296,8 +1328,7 @@ unsigned long sleepStartTime = millis();
 unsigned long sleepCurrentTime = 0;
 
 // portal
-int portalMode = PORTAL_DOWN; 
-bool firstPortal = true;
+volatile int portalMode = PORTAL_DOWN;  // read by the web server's task too
 
 
 /*
@@ -306,150 +1337,113 @@ bool firstPortal = true;
  * 
  */
 void loop() {
+  loopStart = micros();
+
+  while (Serial.available()) {
+    int c = Serial.read();
+    if (c == 's') statsPrint();       // stats on demand
+    else if (c == 'p') profileSet((outputProfile + 1) % PROFILE_COUNT);  // next profile
+    else if (c == 'm') roomSet((roomRole + 1) % ROOM_COUNT);  // next multi-room role
+    else if (c == 't') shiftToggle();   // pause or resume
+  }
+  webService();  // control requests from the web pages
+
+  input_t ev;
   if (systemSleeping) {
     
-    if (rotaryEncoder.isEncoderButtonClicked() ||
-        rotaryEncoder.encoderChanged()) {
+    if (inputRead(&ev) && ev.type != INPUT_RELEASE) {
 
-      // wake from sleep
+      // wake from sleep, the waking turn or press does nothing else
+      inputFlush();
       systemSleeping = false;
       runSleepTimer(timerRunning);  // reset timer
 
-      oled.clear();
+      oledClear();
       oled.println(F("WAKE UP"));
       displayOn = true;
-      oledStartTime = millis(); // tickle the display timer
+      timerStart(TIMER_OLED, OLED_TIMER); // tickle the display timer
     }
 
   }
   else {
 
-    if (systemStreaming) copier.copy();  // Run the open audio stream
-    
-    else {  // start a stream
+    // the open audio stream is run by the audio task
+    if (!systemStreaming) {  // start a stream
 
       if (checkProtocol(currentIndex)) {
         // url seems ok
-        urlstream.begin(streamsGetUrl(currentIndex));
-        urlstream.setMetadataCallback(metadataCallback); // metadata processor
-        settingPut(listened, currentIndex);              // save current selection
+        audioSend(AUDIO_CMD_PLAY, currentIndex);  // audio task opens the url
+        settingPut(listened, currentIndex);       // save current selection
         systemStreaming = true;
       }
       else { 
         // url string length is too short
         currentIndex = settingGet(listened); // get previous stream
         menuIndex = currentIndex;  // reset menu display pointer
-        oled.clear();
+        oledClear();
         oled.println(F("ERROR\nMissing URL\nReverting"));
       }
 
       displayOn = true;
-      oledStartTime = millis(); // reset display timer
+      timerStart(TIMER_OLED, OLED_TIMER); // reset display timer
     }
 
-    if (rotaryEncoder.isEncoderButtonClicked()) { 
-      // button was pressed
-
-      if (volLevel == 0) {
-        // Handle timer or sleep mode
-        oled.clear();
-        sleepCurrentTime = millis();
-
-        if (timerRunning & (sleepCurrentTime - sleepStartTime) < 3000) {
-          // If user presses button within 3 seconds of timer set (twice 
-          // in 3 seconds) when the volume is zero, then fall into cpu 
-          // light-sleep mode. Note that if the timer is running, then the 
-          // first click will be caught by the timer cancel code. It then
-          // takes 2 more clicks to power down.
-          systemPowerDown();
-        }
-
-        else {
-          // Set or reset sleep timer when volume is zero
-          if (timerRunning) {
-            runSleepTimer(false);
-            oled.println(F("CANCEL TIMER"));
-          }
-          else {
-            runSleepTimer(true);
-            oled.println(F("TIMER SET")); 
-            oled.print(SLEEP_TIMER/60000); // convert to minutes
-            oled.println(F(" minutes"));  
-          }
-        }
-
+    if (audioState != streamState) {
+      // connection phase changed in the audio task
+      streamState = audioState;
+      if (streamState == CONN_FAILED && !menuOpen) {
+        oledClear();
+        oled.println(F("STREAM FAIL"));
+        oled.println(streamsGetTag(currentIndex));
+        oled.println((const char*)audioError);
         displayOn = true;
-        oledStartTime = millis(); // tickle the display timer
+        timerStart(TIMER_OLED, OLED_TIMER); // reset display timer
       }
+    }
 
-      else {
-        if (menuOpen) { 
-          // close the menu, prepare selected stream
-          menuOpen = false;
-          rotaryEncoder.setEncoderValue(volumePos);   // restore volume position 
-          currentIndex = menuIndex;  // user chose this stream
-          urlstream.end();           // stop stream download
-          systemStreaming = false;   // signal that another stream is selected
-          oledStatusDisplay();
-        }
-
-        else { 
-          // open the menu, select a stream
-          menuOpen = true;
-          volumePos = rotaryEncoder.readEncoder(); // get volume setting
-          rotaryEncoder.setEncoderValue(50);       // initialize position
-          menuDisplay(currentIndex);  // show stream selection list
-        }
+    if (nowTitleSeq != titleSeq) {
+      // stream title has changed, show it unless the user is busy
+      titleSeq = nowTitleSeq;
+      if (!menuOpen && volLevel != 0 && portalMode != PORTAL_UP && 
+          nowPlayingDisplay()) {
+        displayOn = true;
+        timerStart(TIMER_OLED, OLED_TIMER); // reset display timer
       }
-
-      displayOn = true;
-      oledStartTime = millis(); // tickle the display timer
     }
-  
-    if (rotaryEncoder.encoderChanged()) {   // knob has turned
-
-      if (menuOpen) {  
-        // scroll the menu
-        long encoderCurrPos = rotaryEncoder.readEncoder();
-        if (encoderCurrPos > 50) menuIndex--; // determine direction
-        else menuIndex++;
-        rotaryEncoder.setEncoderValue(50); // re-initialize position
 
-        if (menuIndex >= (TOTAL_ITEMS-1)) menuIndex = 0; // wrap around
-        if (menuIndex < 0) menuIndex = TOTAL_ITEMS-1;
-
-        menuDisplay(menuIndex);  // show stream selection list
+    while (inputRead(&ev)) {
+      // every press and detent since the last pass, in order, a press
+      // counts once it is released and a long one pauses
+      if (ev.type == INPUT_PRESS) {
+        inputPressMs = ev.ms;
+        inputPressed = true;
+        inputTwice = false;
       }
-
-      else { 
-        // Menu is not open, so set the volume level
-        // volLevel value will be saved when oled timeout occurs
-        volLevel = 100 - rotaryEncoder.readEncoder();
-        volume.setVolume(volLevel / 100.0); // set speaker level
-        //settingPut(audiovol, volLevel);   // store the setting (moved)
-        oledStatusDisplay();  
+      else if (ev.type == INPUT_DOUBLE) inputTwice = true;
+      else if (ev.type == INPUT_RELEASE && inputPressed) {
+        inputPressed = false;
+        if (ev.ms - inputPressMs >= INPUT_LONG_MS && !menuOpen && volLevel != 0) 
+          shiftToggle();
+        else inputPress(inputPressMs, inputTwice);
       }
-
-      displayOn = true;
-      oledStartTime = millis(); // tickle the display timer
+      else if (ev.type == INPUT_TURN) inputTurn(ev.delta, ev.ms);
     }
   }
 
   // Turn off oled after a few seconds.
   // Also save volume level here to avoid overusing the prefs data write
-  oledCurrentTime = millis();
-  if (displayOn) {
+  if (timerDue(TIMER_OLED)) {
 
-    if (oledCurrentTime - oledStartTime > OLED_TIMER) {
+    if (displayOn) {
 
       // oled timer has expired, turn it off
       if (menuOpen) {
         menuOpen = false;
         menuIndex = currentIndex;  // no selection, reset menu display pointer
-        rotaryEncoder.setEncoderValue(volumePos);   // restore volume position 
+        audioSend(AUDIO_CMD_COOL, 0); // drop the warm connections
       }
 
-      oled.clear();  // blank the display
+      oledClear();  // blank the display
       displayOn = false;
 
       if (portalMode == PORTAL_UP) StreamPortalMessage(); // an override message
@@ -457,298 +1451,3995 @@ void loop() {
       if (volLevel == 0) systemPowerDown(); // Put into sleep mode
 
       // Store volume level only after user has settled on a value
-      if (volLevel != settingGet(audiovol)) 
-        settingPut(audiovol, volLevel);  // store the setting 
+      settingPut(audiovol, volLevel);  // cached, written back when quiet
     }
   }
 
-  if (!systemSleeping && timerRunning) { 
-    // system is awake and timer is running
+  settingsService();  // write back settled settings
+
+  if (timerDue(TIMER_SLEEP)) { 
+    // sleep timer has run out
     
-    // watch for timeout
-    sleepCurrentTime = millis();
-    if (sleepCurrentTime - sleepStartTime > SLEEP_TIMER) {
+    if (!systemSleeping && timerRunning) {
 
       // timer has expired, go to sleep (silent idle mode)
-      urlstream.end();         // stop stream download
+      audioSend(AUDIO_CMD_STOP, 0); // stop stream download
       systemStreaming = false; // set state signals
       systemSleeping = true;
 
-      oled.clear();
+      oledClear();
       oled.println(F("SLEEPING"));
       displayOn = true;
-      oledStartTime = millis(); // tickle the display timer
+      timerStart(TIMER_OLED, OLED_TIMER); // tickle the display timer
     }
   }
 
-  // Portal functions
-  if (portalMode == PORTAL_UP) wifiMan.process(); // process the portal web page
-  bool portalSwitch = !digitalRead(PORTAL_PIN);   // true when pin is low
+  // Portal functions, the pages are served by the async server's task
+  if (portalSwitch && portalMode == PORTAL_DOWN) {
+    // user call for portal, the server shows the station page from now
+    portalMode = PORTAL_UP; 
+    StreamPortalMessage();
+  }
 
-  if ((portalMode == PORTAL_IDLE) && !portalSwitch) 
-    // switch has been opened. reset the mode
-    portalMode = PORTAL_DOWN; // portal down
-  
-  if (portalSwitch) { 
-    // user call for portal
-    if (portalMode == PORTAL_DOWN) { 
-      // start the portal
-
-      //  set up portal parameters
-      if (firstPortal) {
-        // only instantiate new parameter objects if they have not yet been created
-        firstPortal = false;
-        for (int i=0; i<TOTAL_ITEMS; i++) {
-          tagElementParam[i] = new WiFiManagerParameter{tagElement[i], nameElement[i], streamsGetTag(i), STREAM_ELEMENT_SIZE-1};
-          urlElementParam[i] = new WiFiManagerParameter{urlElement[i], urlElement[i], streamsGetUrl(i), STREAM_ELEMENT_SIZE-1};
-          wifiMan.addParameter(tagElementParam[i]);
-          wifiMan.addParameter(urlElementParam[i]);
-        }
+  if (portalSaved) {
+    // an edited table is live, stationsService() stores it
+    portalSaved = false;
+    if (currentIndex >= stationLive->count) currentIndex = 0;
+    menuIndex = currentIndex;
+    oledClear();
+    oled.println(F("SAVED"));
+    displayOn = true;
+    timerStart(TIMER_OLED, OLED_TIMER); // reset display timer
+  }
+
+  if (!portalSwitch && portalMode != PORTAL_DOWN) {
+    // switch is off, the station page goes
+    portalMode = PORTAL_DOWN;
+
+    oledClear();
+    oled.print(F("PORTAL DOWN"));
+    displayOn = true;
+    timerStart(TIMER_OLED, OLED_TIMER); // reset display timer
+  }
+
+  stationsService();  // store station edits in the background
+  probesService();    // and the station health now and then
+  resolveService();   // and the audio urls behind redirects
+  shiftService();     // and the time shift recording
+
+  if (portalRestart) {
+    // firmware written, give the browser its reply first
+    oledClear();
+    oled.print(F("UPDATED\nRestarting..."));
+    audioStop();
+    settingsFlush();
+    delay(OLED_TIMER);
+    esp_restart();
+  }
+
+  statsAdd(&statLoop, micros() - loopStart);
+  loopWait();  // until the next timer or event
+}
+
+
+
+/*
+ *
+ *    Program Functions
+ *
+ */
+
+/*
+ * Audio pipeline task
+ */
+void audioTask(void* param) {
+  // Owns the connections, decoders, volume and i2s. Runs the stream
+  // copy and services commands from loop() between copies.
+
+  audioCmd_t msg;
+  bool streaming = false;
+  bool bitrateKnown = false;  // watermarks follow the real bitrate once known
+  bool codecReady = false;    // the decoder is set up for this stream
+  bool synced = false;        // the jitter buffer starts with a whole frame
+  size_t syncOwed = 0;        // bytes of an id3 tag still to drop
+  size_t syncDropped = 0;     // bytes dropped before the first frame
+  bool streamUp = false;      // this stream has delivered audio
+  bool connUp = false;        // the current connection has reached the body
+  unsigned long upSince = 0;  // millis() when it did
+  int retries = 0;            // reconnects since the stream was last healthy
+  unsigned long retryAt = 0;  // millis() of the next reconnect
+  uint8_t* span;              // contiguous region of the jitter buffer
+  size_t len;
+  int got;
+  uint32_t titleSeq = 0;      // audioConn title last published
+  unsigned long tuneAt = 0;   // millis() the station was opened, 0 once measured
+
+#if REPLAY_CAPTURES
+  replayCaptures();
+#endif
+
+  audioConn.sock = -1;
+  probeConn.sock = -1;
+  for (int i=0; i<WARM_POOL_SIZE; i++) {
+    warmPool[i].conn.sock = -1;
+    warmPool[i].index = -1;
+  }
+
+  while (true) {
+    // block while idle, otherwise just poll for a new command
+    while (xQueueReceive(audioQueue, &msg, 
+           (streaming || warmBusy() || probeBusy()) ? 0 : pdMS_TO_TICKS(PROBE_GAP_MS)) == pdTRUE) {
+      switch (msg.cmd) {
+        case AUDIO_CMD_PLAY:
+          if (!jitterBuf) {
+            // nothing to stream through, jitterBegin() has said why
+            audioConn.state = CONN_FAILED;
+            audioConn.error = "No buffer";
+            break;
+          }
+          // drops the previous stream, and whatever it left buffered
+          shiftEnd();
+          jitterReset();
+          bitrateKnown = false;
+          codecReady = false;
+          synced = false;
+          syncOwed = syncDropped = 0;
+          streamUp = connUp = false;
+          retries = 0;
+          titleSeq = 0;
+          portENTER_CRITICAL(&nowTitleMux);
+          nowTitle[0] = 0;  // new station, no title yet
+          nowTitleSeq++;
+          portEXIT_CRITICAL(&nowTitleMux);
+          roomMode = roomRole;  // kept for the whole stream
+          profileSelect(outputProfile);  // auto starts over as low
+          driftReset();  // another encoder, another clock
+          outputRun(true);
+          tuneAt = 0;
+          if (roomBegin()) streaming = true;  // a follower, the leader sends it
+          else if (warmAdopt(msg.arg)) streaming = true;  // already open
+          else {
+            tuneAt = millis();  // a cold start, the station's health is measured
+            streaming = connOpen(&audioConn, streamsGetUrl(msg.arg));
+          }
+          warmDrop();  // menu is closed, free the rest of the pool
+          break;
+        case AUDIO_CMD_STOP:
+          connClose(&audioConn);  // stop stream download
+          roomClose();
+          shiftEnd();
+          jitterReset();
+          streaming = false;
+          outputRun(false);
+          break;
+        case AUDIO_CMD_VOLUME:
+          volume.setVolume(msg.arg); // set speaker level, ramped in
+          break;
+        case AUDIO_CMD_WARM:
+          warmWant(msg.arg);
+          break;
+        case AUDIO_CMD_COOL:
+          warmDrop();
+          break;
+        case AUDIO_CMD_PROFILE:
+          profileSelect(msg.arg);
+          break;
+        case AUDIO_CMD_SHIFT:
+          if (msg.arg == SHIFT_OP_PAUSE && shiftState == SHIFT_LIVE) {
+            if (!streaming || !synced || roomMode == ROOM_FOLLOWER) {
+              shiftDone = true;  // nothing to pause, loop() closes the store
+              break;
+            }
+            shiftPage = 0;
+            shiftFill = 0;
+            shiftReady = -1;
+            shiftAsk = 0;
+            shiftAsked = false;
+            if (!shiftRam) profileSelect(PROFILE_ROBUST);  // flash writes stall us
+            shiftState = SHIFT_PAUSED;
+          }
+          else if (msg.arg == SHIFT_OP_PAUSE && shiftState == SHIFT_BEHIND) {
+            shiftState = SHIFT_PAUSED;
+          }
+          else if (msg.arg == SHIFT_OP_RESUME && shiftState == SHIFT_PAUSED) {
+            shiftState = SHIFT_BEHIND;
+          }
+          else if (msg.arg == SHIFT_OP_LIVE && shiftState != SHIFT_LIVE) {
+            shiftEnd();
+            jitterReset();  // what is buffered is old, start over on the network
+            synced = false;
+            syncOwed = syncDropped = 0;
+          }
+          break;
       }
-      else {
-        for (int i=0; i<TOTAL_ITEMS; i++) {
-          WiFiManagerParameter{tagElement[i], nameElement[i], streamsGetTag(i), STREAM_ELEMENT_SIZE-1};
-          WiFiManagerParameter{urlElement[i], urlElement[i], streamsGetUrl(i), STREAM_ELEMENT_SIZE-1};
+      audioActive = streaming;
+      audioError = audioConn.error;
+      audioState = audioConn.state;
+    }
+
+    bool moved = false;
+
+    if (roomMode == ROOM_FOLLOWER && streaming) {
+      // the leader's packets stand in for the station
+      if (!roomFollow()) vTaskDelay(1);
+      continue;
+    }
+
+    // Advance dns, connect and header phases without blocking
+    connStep(&audioConn);
+    warmStep();
+
+    // Network -> jitter buffer, straight into the ring without a copy
+    if (audioConn.state >= CONN_BUFFERING && audioConn.state <= CONN_PLAYING) {
+      if (!connUp) {
+        connUp = streamUp = true;  // body is flowing, start watching it
+        upSince = millis();
+        rateReset();
+        if (!bootConnUs) bootConnUs = esp_timer_get_time();
+        if (tuneAt) probeRecord(audioConn.originHash, true, millis() - tuneAt, 
+                                audioConn.status, audioConn.kbps, audioConn.codec);
+        tuneAt = 0;
+      }
+      got = 0;
+      bool live = shiftState == SHIFT_LIVE;  // else it goes to the recording
+      if ((len = live ? jitterWritePtr(&span) : shiftWritePtr(&span)) > 0) {
+        heapGuard(audioConn.state == CONN_PLAYING && bitrateKnown);
+        got = connRead(&audioConn, span, min(len, (size_t)JITTER_CHUNK));
+        heapGuard(false);
+        if (got > 0) {
+          if (live) jitterCommit(got);
+          else shiftCommit(got);
+          moved = true;
         }
       }
-      wifiMan.setSaveParamsCallback(saveParamsCallback);  // param web page save event
-      wifiMan.startWebPortal();
-      portalMode = PORTAL_UP; 
-      StreamPortalMessage();
+      rateAdd(got > 0 ? got : 0, len == 0);
+      statsNet(got > 0 ? got : 0);
+      if (audioConn.titleSeq != titleSeq) {
+        titleSeq = audioConn.titleSeq;
+        icyPublish(&audioConn);
+      }
+      if (rateStalled(codecBitrate() > 0 ? codecBitrate() : JITTER_DEFAULT_KBPS)) {
+        streamStalls++;
+        connFail(&audioConn, "STALLED");
+      }
+    }
+
+    // Pick the decoder, from the content type or else the first bytes
+    if (audioConn.state >= CONN_BUFFERING && audioConn.state <= CONN_PLAYING) {
+      if (audioConn.codec == CODEC_UNKNOWN && (len = jitterReadPtr(&span)) > 0) {
+        audioConn.codec = codecSniff(span, len);
+        if (audioConn.codec == CODEC_UNKNOWN && len >= CODEC_SNIFF_BYTES) 
+          connFail(&audioConn, "UNKNOWN FORMAT");
+      }
+      if (audioConn.codec == CODEC_NONE) connFail(&audioConn, "UNSUPPORTED");
+      else if (audioConn.codec != CODEC_UNKNOWN) {
+        codecReady = codecSelect(audioConn.codec);
+        if (!codecReady) connFail(&audioConn, "DECODER ERROR");
+      }
     }
-    else { 
-      if (portalMode == PORTAL_SAVE) { 
 
-        // Store data fields from portal into streamsX array
-        for (int i=0; i<TOTAL_ITEMS; i++) {
-          streamsPut(i, tagElementParam[i]->getValue(), urlElementParam[i]->getValue()); 
+    // Drop whatever comes before the first whole frame, and set the marks
+    // and i2s from its header while the buffer is still filling
+    if (codecReady && !synced && (len = jitterReadPtr(&span)) > 0) {
+      if (audioConn.codec != CODEC_MP3 && audioConn.codec != CODEC_AAC) {
+        synced = true;  // ogg pages carry their own sync
+      }
+      else if (syncOwed) {
+        size_t n = min(len, syncOwed);  // the rest of an id3 tag
+        jitterConsume(n);
+        syncOwed -= n;
+      }
+      else {
+        sync_t info;
+        size_t skip;
+        bool flush = len < jitterCount || len >= SYNC_SCAN_BYTES;  // it will not grow
+        int found = syncScan(span, len, audioConn.codec == CODEC_AAC, flush, &info, &skip);
+        size_t n = min(len, skip);
+        jitterConsume(n);
+        syncOwed = skip - n;
+        syncDropped += skip;
+        if (found == SYNC_FOUND) {
+          synced = true;
+          syncAnnounce(&info, syncDropped);
+          if (info.kbps > 0) {
+            jitterSetBitrate(info.kbps);  // before the prefill mark is reached
+            bitrateKnown = true;
+          }
         }
-        // Save changes to the prefs database
-        populatePrefs();  
+        else if (syncDropped > SYNC_GIVE_UP) {
+          synced = true;
+          Serial.printf("No frame sync in %u bytes\n", (unsigned)syncDropped);
+        }
+      }
+    }
 
-        // stop the portal
-        wifiMan.stopWebPortal();
+    // Recording -> jitter buffer, read back by loop()
+    if (shiftState == SHIFT_BEHIND) shiftFeed();
 
-        // set mode according to switch position
-        if (portalSwitch) portalMode = PORTAL_IDLE;
-        else portalMode = PORTAL_DOWN;
+    // Watch the watermarks
+    if (jitterBuffering) {
+      if (jitterCount >= jitterPrefill) {
+        jitterBuffering = false;  // start playback
+        if (audioConn.state == CONN_BUFFERING) audioConn.state = CONN_PLAYING;
+      }
+    }
+    else if (jitterCount < jitterLow) {
+      jitterBuffering = true;  // running dry, pause and rebuffer
+      statRebuffers++;
+      if (audioConn.state == CONN_PLAYING) {
+        audioConn.state = CONN_BUFFERING;
+        audioConn.phaseStart = millis();
+      }
+    }
+    else if (audioConn.state == CONN_BUFFERING) {
+      // reconnected while the buffer was still playing
+      audioConn.state = CONN_PLAYING;
+    }
 
-        oled.clear();
-        oled.println(F("SAVED"));
-        displayOn = true;
-        oledStartTime = millis(); // reset display timer
+    if (audioConn.state == CONN_RETRY && (long)(millis() - retryAt) >= 0) {
+      // the jitter buffer is kept, new bytes queue up behind the old
+      streamReconnects++;
+      connOpen(&audioConn, audioConn.origin);
+      titleSeq = audioConn.titleSeq;  // keep showing the last title
+    }
+    if (audioConn.state == CONN_FAILED && streaming && streamUp) {
+      // a stream that was playing has dropped, try to get it back,
+      // the backoff starts over if the connection had been up a while
+      if (connUp && millis() - upSince > RETRY_HEALTHY_MS) retries = 0;
+      connUp = false;
+      if (retries < RETRY_LIMIT) {
+        unsigned long wait = retryDelay(retries++);
+        Serial.printf("Stream %s, reconnect %d in %lu ms (%u stalls, %u reconnects)\n",
+                      audioConn.error, retries, wait, 
+                      (unsigned)streamStalls, (unsigned)streamReconnects);
+        audioConn.state = CONN_RETRY;
+        retryAt = millis() + wait;
       }
     }
 
-  }
-  else {
-    // switch is off
-    if (portalMode != PORTAL_DOWN) {
-      // force portal shutdown
+    if (audioConn.state == CONN_FAILED) {
+      // dead station or lost stream, wait for the ui to pick another
+      if (streaming && !streamUp) 
+        probeRecord(audioConn.originHash, false, 0, audioConn.status, 0, CODEC_UNKNOWN);
+      shiftEnd();
+      jitterReset();
+      streaming = false;
+      audioActive = false;
+      outputRun(false);
+    }
+    audioError = audioConn.error;
+    if (audioState != audioConn.state) {
+      audioState = audioConn.state;
+      loopWake();  // show the new phase now
+    }
 
-      wifiMan.stopWebPortal();
-      portalMode = PORTAL_DOWN;
+    // Jitter buffer -> decoder, the i2s write paces this loop
+    if (!jitterBuffering && codecReady && synced && shiftState != SHIFT_PAUSED &&
+        (len = jitterReadPtr(&span)) > 0) {
+      int tenths = jitterCount * STATS_FILL_BINS / jitterSize;
+      statsAddBin(&statFill, tenths, tenths);
+      int64_t heard = volume.heardUs();  // the followers are told this
+      heapGuard(bitrateKnown && volume.blocks != 0);  // past the first frames
+      len = decodeWrite(span, min(len, (size_t)JITTER_CHUNK));
+      heapGuard(false);
+      if (roomMode == ROOM_LEADER) roomSend(span, len, heard);
+      jitterConsume(len);
+      moved = true;
+      if (!bootPcmUs && volume.blocks) {
+        bootPcmUs = esp_timer_get_time();
+        bootPrint();  // the first sound since power on
+      }
 
-      oled.clear();
-      oled.print(F("PORTAL DOWN"));
-      displayOn = true;
-      oledStartTime = millis(); // reset display timer
+      if (!bitrateKnown && codecBitrate() > 0) {
+        // first frames are decoded, size the marks from the real bitrate
+        jitterSetBitrate(codecBitrate());
+        bitrateKnown = true;
+      }
     }
+
+    if (streaming) profileWatch();
+    probeStep(!streaming || (audioConn.state == CONN_PLAYING && !jitterBuffering));
+    // behind live the recording takes up the drift, the fill means nothing
+    driftStep(audioConn.state == CONN_PLAYING && !jitterBuffering && bitrateKnown &&
+              shiftState == SHIFT_LIVE);
+    if (jitterBuffering || !codecReady || !synced || shiftState == SHIFT_PAUSED) 
+      volume.idle();  // silence is intended
+    if (!moved) vTaskDelay(1);  // nothing to do, give up the cpu
   }
 }
 
 
-
 /*
- *
- *    Program Functions
- *
+ * Start opening a station url, connStep() does the rest
  */
+bool connOpen(conn_t* conn, const char* url) {
+  // the url is copied so the station table may change underneath us
+
+  if (url != conn->origin) strlcpy(conn->origin, url, CONN_URL_SIZE);
+  conn->originHash = crc32((const uint8_t*)conn->origin, strlen(conn->origin));
+  conn->hops = 0;
+  conn->title[0] = 0;
+  conn->titleUrl[0] = 0;
+  conn->titleSeq = 0;
+
+  // skip the redirects and playlist when the audio url is known
+  const char* resolved = resolveFind(conn->originHash);
+  conn->viaCache = (resolved != NULL);
+  return connStart(conn, resolved ? resolved : conn->origin);
+}
+
 
 /*
- * Parameter web page callback function
+ * Open one url of the chain that leads to the audio
  */
-void saveParamsCallback(void) {
-  // called when the SAVE button is clicked on the 
-  // portal parameter web page -> http://<local_ip>/param
+bool connStart(conn_t* conn, const char* url) {
+  connClose(conn);
+  if (url != conn->url) strlcpy(conn->url, url, CONN_URL_SIZE);
+  conn->error = "";
+  conn->status = 0;
+  conn->lineLen = 0;
+  conn->metaInt = 0;
+  conn->bodyLen = 0;
+  conn->codec = CODEC_UNKNOWN;
+  conn->kbps = 0;
+
+  // split http[s]://host[:port][/path]
+  char* host;
+  if (strncmp(conn->url, "http://", 7) == 0) {
+    host = conn->url + 7;
+    conn->secure = false;
+  }
+  else if (strncmp(conn->url, "https://", 8) == 0) {
+    host = conn->url + 8;
+    conn->secure = true;
+  }
+  else return connFail(conn, "BAD URL");
+  char* slash = strchr(host, '/');
+  size_t hostLen = slash ? (size_t)(slash - host) : strlen(host);
+  conn->path = slash ? slash : "/";
+  if (hostLen >= CONN_HOST_SIZE) return connFail(conn, "BAD HOST");
+  memcpy(conn->host, host, hostLen);
+  conn->host[hostLen] = 0;
+  conn->port = conn->secure ? 443 : 80;
+  char* colon = strchr(conn->host, ':');
+  if (colon) {
+    *colon = 0;
+    conn->port = atoi(colon + 1);
+  }
 
-  portalMode = PORTAL_SAVE; // data save is pending
+  // a playlist is known by its name here, or by its content type later
+  size_t pathLen = strcspn(conn->path, "?#");
+  conn->playlist = 
+    (pathLen >= 4 && strncasecmp(conn->path + pathLen - 4, ".pls", 4) == 0) ||
+    (pathLen >= 4 && strncasecmp(conn->path + pathLen - 4, ".m3u", 4) == 0) ||
+    (pathLen >= 5 && strncasecmp(conn->path + pathLen - 5, ".m3u8", 5) == 0);
+
+  // start the lookup, numeric hosts and cached names complete immediately
+  conn->state = CONN_RESOLVING;
+  conn->phaseStart = millis();
+  dnsQuery_t* q = NULL;
+  for (int i=0; i<DNS_QUERIES && !q; i++) if (!dnsQueries[i].busy) q = &dnsQueries[i];
+  if (!q) return connFail(conn, "DNS BUSY");
+  if (++dnsGenNext == 0) dnsGenNext = 1;  // 0 is no lookup
+  portENTER_CRITICAL(&dnsMux);
+  conn->dnsGen = dnsGenNext;  // an answer to an older lookup is dropped from now
+  conn->dnsState = DNS_PENDING;
+  portEXIT_CRITICAL(&dnsMux);
+  strcpy(q->host, conn->host);
+  q->gen = conn->dnsGen;
+  q->busy = true;
+  if (tcpip_callback(dnsStart, q) != ERR_OK) {
+    q->busy = false;
+    return connFail(conn, "DNS ERROR");
+  }
+  return true;
 }
 
 
 /*
- * Metadata callback function
+ * Start a lookup, runs in the tcpip thread
  */
-void metadataCallback(MetaDataType type, const char* str, int len) {
-  // called when stream metadata is available
-  // note that ICYStream must be used
-
-  Serial.print("==> ");
-  Serial.print(toStr(type));
-  Serial.print(": ");
-  Serial.println(str);
-
-/*  INCOMPLETE * * *
-
-  // Example: Extract the "StreamTitle" field
-  int titleStart = metadata.indexOf("StreamTitle='");
-  if (titleStart != -1) {
-    titleStart += 13; // Move past "StreamTitle='"
-    int titleEnd = metadata.indexOf("';", titleStart);
-    if (titleEnd != -1) {
-      String streamTitle = metadata.substring(titleStart, titleEnd);
-      Serial.println("Now Playing: " + streamTitle);
-    }
-  }
-*/  
+void dnsStart(void* arg) {
+  dnsQuery_t* q = (dnsQuery_t*)arg;
+  uint32_t gen = q->gen;
+  ip_addr_t addr;
+  err_t err = dns_gethostbyname(q->host, &addr, connDnsFound, (void*)(uintptr_t)gen);
+  q->busy = false;  // lwip has its own copy of the name
+  if (err == ERR_OK) dnsResult(gen, &addr);  // numeric or cached
+  else if (err != ERR_INPROGRESS) dnsResult(gen, NULL);
 }
 
 
 /*
- * Enable or disable sleep timer
+ * Dns lookup callback, runs in the tcpip thread
  */
-void runSleepTimer(bool enabled) {
-  // enabled = true to set, false to clear
-  timerRunning = enabled;
-  if (enabled) {
-    sleepStartTime = millis();  // sleep timer baseline
-  }
+void connDnsFound(const char* name, const ip_addr_t* ipaddr, void* arg) {
+  dnsResult((uintptr_t)arg, ipaddr);
 }
 
 
 /*
- * Display the timer, signal, volume level
+ * Hand an answer to the connection still waiting for it, if any
  */
-void oledStatusDisplay(void) {
-
-  int dBm = WiFi.RSSI();
-  oled.clear();
-  oled.println(streamsGetTag(currentIndex)); // stream name
-  if (timerRunning) {
-    oled.print(F("timer : "));
-    oled.println(timerTimeLeft());
+void dnsResult(uint32_t gen, const ip_addr_t* ipaddr) {
+  conn_t* conns[2 + WARM_POOL_SIZE] = {&audioConn, &probeConn};
+  for (int i=0; i<WARM_POOL_SIZE; i++) conns[2 + i] = &warmPool[i].conn;
+  portENTER_CRITICAL(&dnsMux);
+  for (int i=0; i<2 + WARM_POOL_SIZE; i++) {
+    conn_t* conn = conns[i];
+    if (conn->dnsGen != gen || conn->dnsState != DNS_PENDING) continue;
+    if (ipaddr) conn->addr = *ipaddr;
+    conn->dnsState = ipaddr ? DNS_FOUND : DNS_FAILED;
+    conn->dnsGen = 0;  // one answer per lookup
   }
-  oled.print(F("signal: "));
-  oled.print(dBm); 
-  if (dBm >= -30)  oled.println(F(" excellent"));
-  else if (dBm >= -67 ) oled.println(F(" good"));
-    else if (dBm >= -70 ) oled.println(F(" fair"));
-      else if (dBm >= -80 ) oled.println(F(" weak"));
-        else oled.println(F(" very weak"));
-  oled.print(F("volume: "));
-  oled.print(volLevel);
+  portEXIT_CRITICAL(&dnsMux);
 }
 
 
 /*
- * Display the stream configuration portal message
+ * Advance the connection one non-blocking step
  */
-void StreamPortalMessage(void) {
+void connStep(conn_t* conn) {
+  unsigned long elapsed = millis() - conn->phaseStart;
+
+  switch (conn->state) {
+
+    case CONN_RESOLVING: {
+      if (conn->dnsState == DNS_FAILED) connFail(conn, "HOST NOT FOUND");
+      else if (conn->dnsState == DNS_FOUND) {
+        // address is known, start a non-blocking tcp connect
+        struct sockaddr_in sa = {};
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(conn->port);
+        sa.sin_addr.s_addr = ip_2_ip4(&conn->addr)->addr;
+        conn->sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (conn->sock < 0) {
+          connFail(conn, "NO SOCKET");
+          break;
+        }
+        fcntl(conn->sock, F_SETFL, fcntl(conn->sock, F_GETFL, 0) | O_NONBLOCK);
+        if (connect(conn->sock, (struct sockaddr*)&sa, sizeof(sa)) < 0 &&
+            errno != EINPROGRESS) {
+          connFail(conn, "CONNECT ERROR");
+          break;
+        }
+        conn->state = CONN_CONNECTING;
+        conn->phaseStart = millis();
+      }
+      else if (elapsed > CONN_RESOLVE_TIMEOUT) connFail(conn, "DNS TIMEOUT");
+      break;
+    }
 
-  oled.clear();
-  oled.println(F("PORTAL OPEN"));
-  oled.print(WiFi.localIP());
-  oled.println(F("/param"));
+    case CONN_CONNECTING: {
+      // socket turns writable once the connect completes or fails
+      fd_set wfds;
+      FD_ZERO(&wfds);
+      FD_SET(conn->sock, &wfds);
+      struct timeval tv = {0, 0};
+      if (select(conn->sock + 1, NULL, &wfds, NULL, &tv) > 0) {
+        int sockErr = 0;
+        socklen_t errLen = sizeof(sockErr);
+        getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, &sockErr, &errLen);
+        if (sockErr) {
+          connFail(conn, "NO CONNECT");
+          break;
+        }
+        // connected, https first has to shake hands
+        if (conn->secure) tlsStart(conn);
+        else connRequest(conn);
+      }
+      else if (elapsed > CONN_CONNECT_TIMEOUT) connFail(conn, "CONNECT TIMEOUT");
+      break;
+    }
+
+    case CONN_HANDSHAKE: {
+      tlsStep(conn);
+      if (conn->state == CONN_HANDSHAKE && elapsed > CONN_HANDSHAKE_TIMEOUT) 
+        connFail(conn, "TLS TIMEOUT");
+      break;
+    }
+
+    case CONN_HEADERS: {
+      // Read the headers a byte at a time so no body data is pulled
+      // out of the socket, the body belongs to the jitter buffer
+      char c;
+      int got;
+      while ((got = connRecv(conn, &c, 1)) == 1) {
+        if (c == '\r') continue;
+        if (c != '\n') {
+          if (conn->lineLen < CONN_LINE_SIZE - 1) conn->line[conn->lineLen++] = c;
+          continue;
+        }
+        conn->line[conn->lineLen] = 0;
+        if (conn->lineLen == 0) {
+          // blank line, headers are done
+          if (conn->status >= 300 && conn->status < 400) {
+            // connHeader() has put the Location url in place
+            if (++conn->hops > CONN_MAX_HOPS) connFail(conn, "REDIRECT LOOP");
+            else if (conn->path[0]) connFail(conn, "BAD REDIRECT");  // no Location
+            else connStart(conn, conn->url);
+          }
+          else if (conn->status != 200) connFail(conn, "HTTP ERROR");
+          else if (conn->playlist) {
+            conn->state = CONN_PLAYLIST;
+            conn->phaseStart = millis();
+          }
+          else if (conn->codec == CODEC_NONE) connFail(conn, "UNSUPPORTED");
+          else {
+            // found the audio, remember where if it took some finding
+            if (conn->hops > 0) resolveStore(conn->originHash, conn->url);
+            conn->state = CONN_BUFFERING;
+            conn->phaseStart = millis();
+          }
+          return;
+        }
+        connHeader(conn);
+        conn->lineLen = 0;
+      }
+      if (got < 0) connFail(conn, "CLOSED");
+      else if (elapsed > CONN_HEADER_TIMEOUT) connFail(conn, "NO RESPONSE");
+      break;
+    }
+
+    case CONN_PLAYLIST: {
+      connPlaylist(conn);
+      if (conn->state == CONN_PLAYLIST && elapsed > CONN_HEADER_TIMEOUT) 
+        connFail(conn, "NO PLAYLIST");
+      break;
+    }
+
+    case CONN_BUFFERING: {
+      // the audio task promotes the connection to CONN_PLAYING
+      if (elapsed > CONN_BUFFER_TIMEOUT) connFail(conn, "NO DATA");
+      break;
+    }
+  }
 }
 
 
 /*
- * Display the Wifi configuration portal message
+ * Handle one http response header line
  */
-void wifiPortalMessage(void) {
+void connHeader(conn_t* conn) {
+  char* line = conn->line;
 
-  oled.clear();
-  oled.println(F("WIFI PORTAL"));
-  oled.println(F("Configure at"));
-  oled.print(F("ssid: "));
-  oled.println(portalName);
-  oled.println(F("ip:   192.168.4.1"));
+  if (conn->status == 0) {
+    // status line, "HTTP/1.x 200 OK" or shoutcast "ICY 200 OK"
+    char* sp = strchr(line, ' ');
+    conn->status = sp ? atoi(sp + 1) : -1;
+  }
+  else if (strncasecmp(line, "icy-metaint:", 12) == 0) {
+    // metadata block interval, the first block follows metaInt audio bytes
+    conn->metaInt = atoi(line + 12);
+    conn->metaCount = conn->metaInt;
+    conn->metaLeft = -1;
+  }
+  else if (conn->status >= 300 && conn->status < 400 && 
+           strncasecmp(line, "location:", 9) == 0) connLocation(conn, line + 9);
+  else if (strncasecmp(line, "content-type:", 13) == 0) {
+    // playlists served under a name that does not give them away
+    const char* types[] = {"audio/x-scpls", "audio/scpls", "application/pls+xml",
+      "audio/x-mpegurl", "audio/mpegurl", "application/x-mpegurl",
+      "application/vnd.apple.mpegurl"};
+    char* type = line + 13;
+    while (*type == ' ') type++;
+    type[strcspn(type, " ;")] = 0;  // drop "; charset=..."
+    for (size_t i=0; i<sizeof(types)/sizeof(types[0]); i++)
+      if (strcasecmp(type, types[i]) == 0) conn->playlist = true;
+    conn->codec = codecFromType(type);
+  }
+  else if (strncasecmp(line, "icy-br:", 7) == 0) conn->kbps = atoi(line + 7);
 }
 
 
 /*
- * Return the minutes left on the timer
+ * Put a redirect target in conn->url, relative ones on the current host
  */
-String timerTimeLeft(void) {
-
-    sleepCurrentTime = millis(); // set baseline
-
-    // calculate time left
-    long totalSeconds = SLEEP_TIMER/1000 - ((sleepCurrentTime - sleepStartTime)/1000);
-    int minutes = (totalSeconds % 3600) / 60;
-    return String(minutes) + " mins";
+void connLocation(conn_t* conn, const char* loc) {
+  // the request has been sent, so url and path are free to overwrite
+  while (*loc == ' ') loc++;
+  if (*loc == '/') {
+    char base[CONN_HOST_SIZE + 16];
+    snprintf(base, sizeof(base), "%s://%s:%u", conn->secure ? "https" : "http",
+             conn->host, conn->port);
+    snprintf(conn->url, CONN_URL_SIZE, "%s%s", base, loc);
+  }
+  else strlcpy(conn->url, loc, CONN_URL_SIZE);
+  conn->path = "";  // marks the url as replaced
 }
 
 
 /*
- * Display the stream selection menu
+ * Read a playlist body up to its first stream url and follow that
  */
-void menuDisplay(int menuIndex) {
-  
-  oled.clear();
-  oled.println(streamsGetTag(currentIndex));  // title line
-
-  // previous line item
-  int lineIndex = (menuIndex == 0 ? (TOTAL_ITEMS-1) : menuIndex-1);
-  //oled.print(F(" ")); // indent
-  if (checkProtocol(lineIndex)) oled.println(streamsGetTag(lineIndex));
-  else oled.println(lineIndex+1); // print only line number if error
-  
-  // current line item
-  if (checkProtocol(menuIndex)) {  // selection line
-    oled.setInvertMode(true);
-    //oled.print(F(">")); // current item pointer
-    oled.println(streamsGetTag(menuIndex));
-    oled.setInvertMode(false);
-  } 
-  else {
-    //oled.print(F(" ")); // indent
-    oled.println(menuIndex+1);
+void connPlaylist(conn_t* conn) {
+  // pls has "File1=url" lines, m3u has the url on each line not
+  // starting with '#', taking any line beginning with http covers both
+  char c;
+  int got;
+  while ((got = connRecv(conn, &c, 1)) == 1) {
+    if (++conn->bodyLen > CONN_PLAYLIST_MAX) {
+      connFail(conn, "BAD PLAYLIST");
+      return;
+    }
+    if (c != '\r' && c != '\n') {
+      if (conn->lineLen < CONN_LINE_SIZE - 1) conn->line[conn->lineLen++] = c;
+      continue;
+    }
+    conn->line[conn->lineLen] = 0;
+    conn->lineLen = 0;
+    char* url = conn->line;
+    if (strncasecmp(url, "file", 4) == 0 && strchr(url, '=')) url = strchr(url, '=') + 1;
+    while (*url == ' ') url++;
+    if (strncmp(url, "http://", 7) != 0 && strncmp(url, "https://", 8) != 0) continue;
+    url[strcspn(url, " \t")] = 0;  // trailing blanks
+    if (++conn->hops > CONN_MAX_HOPS) connFail(conn, "REDIRECT LOOP");
+    else connStart(conn, url);
+    return;
   }
-  
-  // next line item
-  lineIndex = (menuIndex == (TOTAL_ITEMS-1) ? 0 : menuIndex+1);
-  //oled.print(F(" ")); // indent
-  if (checkProtocol(lineIndex)) oled.println(streamsGetTag(lineIndex));
-  else oled.print(lineIndex+1);
+  if (got < 0) connFail(conn, "BAD PLAYLIST");  // ended without a url
 }
 
 
 /*
- * Return true if the url protocol text is correct
+ * Send the http request, it easily fits the empty send buffer
  */
-bool checkProtocol(int menuIndex) {
-  return strncmp(streamsGetUrl(menuIndex), "http://", 7) == 0;
+bool connRequest(conn_t* conn) {
+  char req[CONN_URL_SIZE + CONN_HOST_SIZE + 112];
+  int reqLen = snprintf(req, sizeof(req),
+    "GET %s HTTP/1.0\r\nHost: %s\r\nUser-Agent: AetherStreamer\r\n"
+    "Accept: */*\r\n%sConnection: close\r\n\r\n", conn->path, conn->host,
+    ICY_METADATA ? "Icy-MetaData: 1\r\n" : "");
+  int sent = conn->tls ? mbedtls_ssl_write(conn->tls, (const unsigned char*)req, reqLen)
+                       : send(conn->sock, req, reqLen, 0);
+  if (sent != reqLen) return connFail(conn, "SEND ERROR");
+  conn->state = CONN_HEADERS;
+  conn->phaseStart = millis();
+  return true;
 }
 
 
 /*
- * Retrieve a persistent preference setting
+ * Receive from the socket or through tls, 0 when nothing is waiting
  */
-int settingGet(const char* setting) {
-  prefs.begin(settings, PREF_RO);
-  int settingVal = prefs.getInt(setting, 0); // default = 0
-  prefs.end();
-  return settingVal;
+int connRecv(conn_t* conn, void* buf, size_t len) {
+  // returns -1 once the connection is closed or broken
+  if (conn->tls) {
+    int got = mbedtls_ssl_read(conn->tls, (unsigned char*)buf, len);
+    if (got > 0) return got;
+    if (got == MBEDTLS_ERR_SSL_WANT_READ || got == MBEDTLS_ERR_SSL_WANT_WRITE) return 0;
+#ifdef MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET
+    if (got == MBEDTLS_ERR_SSL_RECEIVED_NEW_SESSION_TICKET) return 0;  // tls 1.3
+#endif
+    return -1;
+  }
+  int got = recv(conn->sock, buf, len, MSG_DONTWAIT);
+  if (got > 0) return got;
+  if (got < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) return 0;
+  return -1;
 }
 
 
 /*
- * Store a persistent preference setting
+ * Read audio bytes, returns 0 when nothing is waiting
  */
-void settingPut(const char* setting, int settingVal) {
-  prefs.begin(settings, PREF_RW);
-  prefs.putInt(setting, settingVal);
-  prefs.end();
+int connRead(conn_t* conn, uint8_t* buf, size_t len) {
+  // metadata blocks are taken out of the stream here
+
+  if (conn->metaInt > 0) {
+    if (conn->metaCount == 0 && icyRead(conn) <= 0) return 0;
+    len = min(len, (size_t)conn->metaCount);  // stop at the next block
+  }
+
+  int got = connRecv(conn, buf, len);
+  if (got > 0) {
+    if (conn->metaInt > 0) conn->metaCount -= got;
+    return got;
+  }
+  if (got < 0) connFail(conn, "STREAM LOST");
+  return 0;
 }
 
 
 /*
- * Load the streamsX array with streams that are saved in prefs object
+ * Consume an icy metadata block, returns 1 once it is complete
  */
-void populateStreams(void) {  
-  // This function will initialize default streams when nvs is blank
-  // You can manually re-load the default streams by pulling STREAM_PIN low at boot.
+int icyRead(conn_t* conn) {
+  char buf[ICY_CHUNK];
+  int got;
+
+  if (conn->metaLeft < 0) {
+    // length byte, block size in units of 16 bytes
+    uint8_t blocks;
+    got = connRecv(conn, &blocks, 1);
+    if (got <= 0) goto noData;
+    if (blocks == 0) {
+      // empty block, the current metadata still holds
+      conn->metaCount = conn->metaInt;
+      return 1;
+    }
+    conn->metaLeft = blocks * 16;
+    conn->icyState = ICY_KEY;
+    conn->icyKeyLen = 0;
+    conn->icyDest = NULL;
+    conn->icyTitle[0] = 0;
+    conn->icyUrl[0] = 0;
+  }
+
+  while (conn->metaLeft > 0) {
+    got = connRecv(conn, buf, min(conn->metaLeft, ICY_CHUNK));
+    if (got <= 0) goto noData;
+    icyParse(conn, buf, got);
+    conn->metaLeft -= got;
+  }
+
+  icyBlockEnd(conn);
+  conn->metaCount = conn->metaInt;  // back to audio
+  conn->metaLeft = -1;
+  return 1;
+
+noData:
+  if (got < 0) connFail(conn, "STREAM LOST");
+  return 0;
+}
+
+
+/*
+ * Parse a piece of an icy metadata block in place
+ */
+void icyParse(conn_t* conn, const char* buf, int len) {
+  // blocks look like StreamTitle='Artist - Song';StreamUrl='...';
+  // padded with nuls. Values may hold quotes, only "';" ends one.
+
+  for (int i=0; i<len; i++) {
+    char c = buf[i];
+
+    switch (conn->icyState) {
+      case ICY_KEY:
+        if (c == '=') {
+          conn->icyKey[conn->icyKeyLen] = 0;
+          conn->icyState = ICY_OPEN;
+          // pick the destination buffer, unknown keys are skipped
+          conn->icyDest = NULL;
+          if (strcmp(conn->icyKey, "StreamTitle") == 0) {
+            conn->icyDest = conn->icyTitle;
+            conn->icyDestSize = ICY_TITLE_SIZE;
+          }
+          else if (strcmp(conn->icyKey, "StreamUrl") == 0) {
+            conn->icyDest = conn->icyUrl;
+            conn->icyDestSize = ICY_URL_SIZE;
+          }
+          conn->icyLen = 0;
+        }
+        else if (c != 0 && c != ';' && conn->icyKeyLen < ICY_KEY_SIZE - 1) 
+          conn->icyKey[conn->icyKeyLen++] = c;
+        break;
+
+      case ICY_OPEN:
+        conn->icyState = (c == '\'') ? ICY_VALUE : ICY_KEY;
+        conn->icyKeyLen = 0;
+        break;
+
+      case ICY_QUOTE:
+        if (c == ';') {
+          icyValueEnd(conn);
+          break;
+        }
+        // the quote was part of the value
+        if (conn->icyDest && conn->icyLen < conn->icyDestSize - 1) 
+          conn->icyDest[conn->icyLen++] = '\'';
+        conn->icyState = ICY_VALUE;
+        // fall through
+      case ICY_VALUE:
+        if (c == '\'') conn->icyState = ICY_QUOTE;
+        else if (conn->icyDest && conn->icyLen < conn->icyDestSize - 1) 
+          conn->icyDest[conn->icyLen++] = c;
+        break;
+    }
+  }
+}
+
+
+/*
+ * Terminate the metadata value being parsed
+ */
+void icyValueEnd(conn_t* conn) {
+  if (conn->icyDest) conn->icyDest[conn->icyLen] = 0;
+  conn->icyDest = NULL;
+  conn->icyState = ICY_KEY;
+  conn->icyKeyLen = 0;
+}
+
+
+/*
+ * A metadata block is complete, keep the title if it has changed
+ */
+void icyBlockEnd(conn_t* conn) {
+  if (conn->icyState == ICY_QUOTE) icyValueEnd(conn); // final ';' missing
+  if (conn->icyState != ICY_KEY) return;              // truncated value
+
+  if (strcmp(conn->icyTitle, conn->title) != 0) {
+    strcpy(conn->title, conn->icyTitle);
+    strcpy(conn->titleUrl, conn->icyUrl);
+    conn->titleSeq++;
+  }
+}
+
+
+/*
+ * Hand the stream title over to loop()
+ */
+void icyPublish(conn_t* conn) {
+  portENTER_CRITICAL(&nowTitleMux);
+  strcpy(nowTitle, conn->title);
+  nowTitleSeq++;
+  portEXIT_CRITICAL(&nowTitleMux);
+  loopWake();
+}
+
+
+/*
+ * Close the connection and return to idle
+ */
+void connClose(conn_t* conn) {
+  if (conn->tls) mbedtls_ssl_close_notify(conn->tls);  // best effort
+  tlsFree(conn);
+  if (conn->sock >= 0) close(conn->sock);
+  conn->sock = -1;
+  conn->dnsGen = 0;  // a lookup still out finds no one
+  conn->state = CONN_IDLE;
+}
+
+
+/*
+ * Copy a connection to another slot, with its inner pointers moved along
+ */
+void connMove(conn_t* to, const conn_t* from) {
+  // path and icyDest point into the connection's own buffers, or at a
+  // literal that stays where it is
+  uintptr_t base = (uintptr_t)from;
+  *to = *from;
+  if ((uintptr_t)from->path - base < sizeof(conn_t))
+    to->path = (const char*)to + ((uintptr_t)from->path - base);
+  if (from->icyDest) to->icyDest = (char*)to + ((uintptr_t)from->icyDest - base);
+}
+
+
+/*
+ * Abandon a connection, always returns false
+ */
+bool connFail(conn_t* conn, const char* reason) {
+  tlsFree(conn);
+  if (conn->sock >= 0) close(conn->sock);
+  conn->sock = -1;
+
+  if (conn->viaCache && conn->state < CONN_BUFFERING) {
+    // the remembered url has gone stale, resolve the station again
+    Serial.printf("Resolved url failed: %s, retrying %s\n", reason, conn->origin);
+    resolveDrop(conn->originHash);
+    conn->viaCache = false;
+    conn->hops = 0;
+    return connStart(conn, conn->origin);
+  }
+
+  conn->state = CONN_FAILED;
+  conn->error = reason;
+  Serial.printf("Stream failed: %s\n", reason);
+  return false;
+}
+
+
+/*
+ * Look up the audio url remembered for a station, NULL if there is none
+ */
+const char* resolveFind(uint32_t hash) {
+  for (int i=0; i<RESOLVE_SLOTS; i++) {
+    resolved_t* slot = &resolveCache[i];
+    if (slot->hash != hash || hash == 0) continue;
+    if (millis() - slot->stored > RESOLVE_TTL) {
+      slot->hash = 0;  // expired, resolve again
+      return NULL;
+    }
+    slot->used = millis();
+    return slot->url;
+  }
+  return NULL;
+}
+
+
+/*
+ * Remember the audio url of a station, replacing the oldest entry
+ */
+void resolveStore(uint32_t hash, const char* url) {
+  // the station's own entry, else a free one, else the least used
+  int slot = 0;
+  for (int i=0; i<RESOLVE_SLOTS; i++) {
+    if (resolveCache[i].hash == hash) {
+      slot = i;
+      break;
+    }
+    if (resolveCache[slot].hash == 0) continue;
+    if (resolveCache[i].hash == 0 || resolveCache[i].used < resolveCache[slot].used) slot = i;
+  }
+  resolveCache[slot].hash = hash;
+  resolveCache[slot].stored = resolveCache[slot].used = millis();
+  resolveCache[slot].boots = 0;
+  strlcpy(resolveCache[slot].url, url, CONN_URL_SIZE);
+  resolveDirty = true;  // resolveService() stores it
+}
+
+
+/*
+ * Forget the audio url of a station
+ */
+void resolveDrop(uint32_t hash) {
+  for (int i=0; i<RESOLVE_SLOTS; i++) {
+    if (resolveCache[i].hash != hash) continue;
+    resolveCache[i].hash = 0;
+    resolveDirty = true;
+  }
+}
+
+
+/*
+ * Read the urls remembered by the last runs, one boot older
+ */
+void resolveLoad(void) {
+  // packed as magic, then hash, boots, length and url of each, then crc32
+  size_t cap = 8 + RESOLVE_SLOTS * (6 + CONN_URL_SIZE);
+  uint8_t* store = (uint8_t*)malloc(cap);
+  if (!store) return;
+  prefs.begin(resolvePrefs, PREF_RO);
+  size_t len = prefs.getBytes(tableKey, store, cap);
+  prefs.end();
+  uint32_t magic, crc;
+  if (len >= 8) {
+    memcpy(&magic, store, 4);
+    memcpy(&crc, store + len - 4, 4);
+  }
+  if (len < 8 || magic != RESOLVE_MAGIC || crc != crc32(store, len - 4)) {
+    free(store);
+    return;
+  }
+  size_t at = 4;
+  for (int i=0; i<RESOLVE_SLOTS && at + 6 <= len - 4; i++) {
+    resolved_t* slot = &resolveCache[i];
+    size_t urlLen = store[at + 5];
+    if (at + 6 + urlLen > len - 4) break;
+    memcpy(&slot->hash, store + at, 4);
+    slot->boots = store[at + 4] + 1;
+    memcpy(slot->url, store + at + 6, urlLen);
+    slot->url[urlLen] = 0;
+    slot->stored = slot->used = 0;  // millis() has started over
+    if (slot->boots >= RESOLVE_BOOTS) slot->hash = 0;  // too old, resolve again
+    at += 6 + urlLen;
+  }
+  free(store);
+  resolveDirty = true;  // the boot counts moved on
+}
+
+
+/*
+ * Write the remembered urls to prefs, at most every RESOLVE_SAVE_DELAY
+ */
+void resolveService(void) {
+  if (!resolveDirty || millis() - resolveSaved < RESOLVE_SAVE_DELAY) return;
+  uint8_t* store = (uint8_t*)malloc(8 + RESOLVE_SLOTS * (6 + CONN_URL_SIZE));
+  if (!store) return;
+  resolveDirty = false;  // before the copy, so a url landing meanwhile is kept
+  uint32_t magic = RESOLVE_MAGIC;
+  memcpy(store, &magic, 4);
+  size_t len = 4;
+  for (int i=0; i<RESOLVE_SLOTS; i++) {
+    resolved_t* slot = &resolveCache[i];
+    if (slot->hash == 0) continue;
+    // the audio task may be storing one, a torn url fails once and is dropped
+    size_t urlLen = strnlen(slot->url, CONN_URL_SIZE-1);
+    memcpy(store + len, &slot->hash, 4);
+    store[len + 4] = slot->boots;
+    store[len + 5] = urlLen;
+    memcpy(store + len + 6, slot->url, urlLen);
+    len += 6 + urlLen;
+  }
+  uint32_t crc = crc32(store, len);
+  memcpy(store + len, &crc, 4);
+  prefs.begin(resolvePrefs, PREF_RW);
+  prefs.putBytes(tableKey, store, len + 4);
+  prefs.end();
+  resolveSaved = millis();
+  free(store);
+}
+
+
+/*
+ * Set up the tls config shared by all connections
+ */
+bool tlsBegin(void) {
+  if (tlsReady) return true;
+  mbedtls_ssl_config_init(&tlsConf);
+  if (mbedtls_ssl_config_defaults(&tlsConf, MBEDTLS_SSL_IS_CLIENT,
+      MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0) return false;
+  mbedtls_ssl_conf_authmode(&tlsConf, TLS_VERIFY ? MBEDTLS_SSL_VERIFY_REQUIRED 
+                                                 : MBEDTLS_SSL_VERIFY_NONE);
+  mbedtls_ssl_conf_rng(&tlsConf, tlsRandom, NULL);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  mbedtls_ssl_conf_session_tickets(&tlsConf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+  for (int i=0; i<TLS_SESSIONS; i++) {
+    mbedtls_ssl_session_init(&tlsSessions[i].session);
+    tlsSessions[i].host[0] = 0;
+  }
+  tlsReady = true;
+  return true;
+}
+
+
+/*
+ * Wrap the connected socket in tls and start the handshake
+ */
+bool tlsStart(conn_t* conn) {
+  conn->tlsHeapStart = conn->tlsHeapLow = esp_get_free_heap_size();
+  conn->tlsStart = millis();
+  if (!tlsBegin()) return connFail(conn, "TLS CONFIG");
+
+  conn->tls = (mbedtls_ssl_context*)calloc(1, sizeof(mbedtls_ssl_context));
+  if (!conn->tls) return connFail(conn, "TLS NO MEMORY");
+  mbedtls_ssl_init(conn->tls);
+  if (mbedtls_ssl_setup(conn->tls, &tlsConf) != 0) return connFail(conn, "TLS NO MEMORY");
+  mbedtls_ssl_set_hostname(conn->tls, conn->host);  // sni, most hosts need it
+  // the socket number is the bio context, so the conn_t may be copied
+  mbedtls_ssl_set_bio(conn->tls, (void*)(intptr_t)conn->sock, tlsSend, tlsRecv, NULL);
+
+  // offer the session from the last visit to this host
+  conn->tlsResume = false;
+  for (int i=0; i<TLS_SESSIONS; i++) {
+    if (strcmp(tlsSessions[i].host, conn->host) != 0) continue;
+    conn->tlsResume = mbedtls_ssl_set_session(conn->tls, &tlsSessions[i].session) == 0;
+    tlsSessions[i].used = millis();
+    break;
+  }
+
+  conn->state = CONN_HANDSHAKE;
+  conn->phaseStart = millis();
+  tlsStep(conn);  // the client hello can go out right away
+  return true;
+}
+
+
+/*
+ * Advance the tls handshake, then send the request
+ */
+void tlsStep(conn_t* conn) {
+  int ret = mbedtls_ssl_handshake(conn->tls);
+  uint32_t heap = esp_get_free_heap_size();
+  if (heap < conn->tlsHeapLow) conn->tlsHeapLow = heap;
+  if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) return;
+  if (ret != 0) {
+    Serial.printf("TLS error -0x%04x\n", -ret);
+    connFail(conn, "TLS ERROR");
+    return;
+  }
+
+  // keep the session for next time, in the slot of this host or the oldest
+  int slot = 0;
+  for (int i=0; i<TLS_SESSIONS; i++) {
+    if (strcmp(tlsSessions[i].host, conn->host) == 0) {
+      slot = i;
+      break;
+    }
+    if (tlsSessions[i].used < tlsSessions[slot].used) slot = i;
+  }
+  tlsSession_t* cache = &tlsSessions[slot];
+  mbedtls_ssl_session_free(&cache->session);
+  mbedtls_ssl_session_init(&cache->session);
+  if (mbedtls_ssl_get_session(conn->tls, &cache->session) == 0) 
+    strlcpy(cache->host, conn->host, CONN_HOST_SIZE);
+  else cache->host[0] = 0;
+  cache->used = millis();
+
+  Serial.printf("TLS %s: handshake %lu ms, heap peak %lu bytes, %s\n", conn->host,
+                millis() - conn->tlsStart, 
+                (unsigned long)(conn->tlsHeapStart - conn->tlsHeapLow),
+                conn->tlsResume ? "session offered" : "new session");
+  connRequest(conn);
+}
+
+
+/*
+ * Release the tls context of a connection
+ */
+void tlsFree(conn_t* conn) {
+  if (!conn->tls) return;
+  mbedtls_ssl_free(conn->tls);
+  free(conn->tls);
+  conn->tls = NULL;
+}
+
+
+/*
+ * Tls output, non-blocking
+ */
+int tlsSend(void* ctx, const unsigned char* buf, size_t len) {
+  int sent = send((int)(intptr_t)ctx, buf, len, MSG_DONTWAIT);
+  if (sent >= 0) return sent;
+  if (errno == EWOULDBLOCK || errno == EAGAIN) return MBEDTLS_ERR_SSL_WANT_WRITE;
+  return MBEDTLS_ERR_NET_SEND_FAILED;
+}
+
+
+/*
+ * Tls input, non-blocking
+ */
+int tlsRecv(void* ctx, unsigned char* buf, size_t len) {
+  int got = recv((int)(intptr_t)ctx, buf, len, MSG_DONTWAIT);
+  if (got > 0) return got;
+  if (got == 0) return MBEDTLS_ERR_NET_CONN_RESET;  // peer went away
+  if (errno == EWOULDBLOCK || errno == EAGAIN) return MBEDTLS_ERR_SSL_WANT_READ;
+  return MBEDTLS_ERR_NET_RECV_FAILED;
+}
+
+
+/*
+ * Tls random numbers from the hardware rng, radio is on so it is true random
+ */
+int tlsRandom(void* ctx, unsigned char* buf, size_t len) {
+  esp_fill_random(buf, len);
+  return 0;
+}
+
+
+/*
+ * Pre-connect the stations around the highlighted menu item
+ */
+void warmWant(int index) {
+  // wanted in priority order: the item itself, then below and above it
+  int want[3] = {
+    index,
+    index == (stationLive->count-1) ? 0 : index+1,
+    index == 0 ? (stationLive->count-1) : index-1
+  };
+  int count = WARM_POOL_SIZE;
+
+  // close connections that have scrolled out of view
+  for (int i=0; i<WARM_POOL_SIZE; i++) {
+    bool keep = false;
+    for (int w=0; w<count; w++) keep |= (warmPool[i].index == want[w]);
+    if (!keep && warmPool[i].index >= 0) {
+      connClose(&warmPool[i].conn);
+      warmPool[i].index = -1;
+    }
+  }
+
+  // open the missing ones, but not the stream that is already playing
+  for (int w=0; w<count; w++) {
+    bool isOpen = false;
+    int slot = -1;
+    for (int i=0; i<WARM_POOL_SIZE; i++) {
+      isOpen |= (warmPool[i].index == want[w]);
+      if (warmPool[i].index < 0 && slot < 0) slot = i;
+    }
+    if (isOpen || slot < 0 || !checkProtocol(want[w])) continue;
+    // a tls context would take most of the pool budget on its own,
+    // https stations rely on session resumption to start quickly instead
+    if (strncmp(streamsGetUrl(want[w]), "https://", 8) == 0) continue;
+    if (audioConn.state != CONN_IDLE && audioConn.state != CONN_FAILED &&
+        strcmp(audioConn.origin, streamsGetUrl(want[w])) == 0) continue;
+
+    warmPool[slot].index = want[w];
+    warmPool[slot].len = 0;
+    connOpen(&warmPool[slot].conn, streamsGetUrl(want[w]));
+  }
+}
+
+
+/*
+ * Advance the warm connections and top up their prebuffers
+ */
+void warmStep(void) {
+  for (int i=0; i<WARM_POOL_SIZE; i++) {
+    warm_t* warm = &warmPool[i];
+    if (warm->index < 0) continue;
+
+    connStep(&warm->conn);
+    // once the prebuffer is full the tcp window holds the server off
+    if (warm->conn.state == CONN_BUFFERING && warm->len < WARM_PREBUFFER) {
+      int got = connRead(&warm->conn, warm->buf + warm->len, WARM_PREBUFFER - warm->len);
+      if (got > 0) warm->len += got;
+    }
+    // a failed slot keeps its index so a dead station is not retried
+    // on every knob step, it is freed once it scrolls out of view
+  }
+}
+
+
+/*
+ * Take over a warm connection for the stream, returns false if none
+ */
+bool warmAdopt(int index) {
+  for (int i=0; i<WARM_POOL_SIZE; i++) {
+    warm_t* warm = &warmPool[i];
+    
+    // a lookup in flight reports to the slot it started from, so
+    // only connections past dns can move to the stream
+    if (warm->index != index || warm->conn.state < CONN_CONNECTING ||
+        warm->conn.state > CONN_BUFFERING) continue;
+
+    connClose(&audioConn);
+    connMove(&audioConn, &warm->conn);
+    audioConn.phaseStart = millis();
+    warm->conn.sock = -1;           // socket now belongs to audioConn
+    warm->conn.tls = NULL;
+    warm->index = -1;
+
+    // the prebuffered audio is enough to start with
+    jitterPut(warm->buf, min(warm->len, jitterSize - jitterCount));
+    if (jitterFill() > 2 * jitterLow) jitterPrefill = jitterFill();
+    return true;
+  }
+  return false;
+}
+
+
+/*
+ * Return true while any warm connection is open
+ */
+bool warmBusy(void) {
+  for (int i=0; i<WARM_POOL_SIZE; i++) 
+    if (warmPool[i].index >= 0) return true;
+  return false;
+}
+
+
+/*
+ * Return the health entry of a url hash, optionally taking a slot for it
+ */
+probe_t* probeFind(uint32_t hash, bool create) {
+  // the url's own entry, else a free one, else the stalest
+  if (hash == 0) return NULL;
+  int slot = 0;
+  for (int i=0; i<PROBE_SLOTS; i++) {
+    if (probes[i].hash == hash) return &probes[i];
+    if (probes[slot].hash == 0) continue;
+    if (probes[i].hash == 0 || probes[i].at < probes[slot].at) slot = i;
+  }
+  if (!create) return NULL;
+  memset(&probes[slot], 0, sizeof(probe_t));
+  probes[slot].hash = hash;
+  return &probes[slot];
+}
+
+
+/*
+ * Note how a station answered, from a probe or a tune
+ */
+void probeRecord(uint32_t hash, bool ok, unsigned long ms, int status, int kbps, int codec) {
+  probe_t* p = probeFind(hash, true);
+  p->at = max(millis(), 1UL);
+  p->status = status;
+  if (ok) {
+    p->connectMs = min(ms, 65535UL);
+    p->kbps = kbps;
+    p->codec = codec;
+    p->fails = 0;
+  }
+  else if (p->fails < 255) p->fails++;
+  probesDirty = true;  // probesService() stores it
+}
+
+
+/*
+ * Advance the probe in flight, or start the next one when quiet
+ */
+void probeStep(bool quiet) {
+  if (probeIndex >= 0) {
+    connStep(&probeConn);
+    if (probeConn.state == CONN_FAILED) 
+      probeRecord(probeConn.originHash, false, 0, probeConn.status, 0, CODEC_UNKNOWN);
+    else if (probeConn.state >= CONN_BUFFERING)
+      probeRecord(probeConn.originHash, true, millis() - probeAt, 
+                  probeConn.status, probeConn.kbps, probeConn.codec);
+    else return;  // still on its way
+    connClose(&probeConn);  // the headers were all we wanted
+    probeIndex = -1;
+    return;
+  }
+  if (!quiet || warmBusy() || WiFi.status() != WL_CONNECTED || 
+      millis() - probeAt < PROBE_GAP_MS) return;
+
+  // the next station of the round that is due
+  int count = stationLive->count;
+  for (int n=0; n<count; n++) {
+    int i = (probeNext + n) % count;
+    const char* url = streamsGetUrl(i);
+    if (!checkProtocol(i)) continue;
+    if (audioActive && strncmp(url, "https://", 8) == 0) continue;
+    if (audioConn.state != CONN_IDLE && audioConn.state != CONN_FAILED &&
+        strcmp(audioConn.origin, url) == 0) continue;  // the stream tells us
+    probe_t* p = probeFind(crc32((const uint8_t*)url, strlen(url)), false);
+    if (p && p->at && millis() - p->at < PROBE_AGE_MS) continue;
+
+    probeNext = i + 1;
+    probeIndex = i;
+    probeAt = millis();
+    connOpen(&probeConn, url);
+    return;
+  }
+  probeAt = millis();  // nothing due, look again after the gap
+}
+
+
+/*
+ * Return true while a probe is in flight
+ */
+bool probeBusy(void) {
+  return probeIndex >= 0;
+}
+
+
+/*
+ * Return true when a station has failed often enough to be marked
+ */
+bool probeDead(int index) {
+  const char* url = streamsGetUrl(index);
+  probe_t* p = probeFind(crc32((const uint8_t*)url, strlen(url)), false);
+  return p && p->fails >= PROBE_DEAD_FAILS;
+}
+
+
+/*
+ * Close all warm connections
+ */
+void warmDrop(void) {
+  for (int i=0; i<WARM_POOL_SIZE; i++) {
+    if (warmPool[i].index < 0) continue;
+    connClose(&warmPool[i].conn);
+    warmPool[i].index = -1;
+  }
+}
+
+
+/*
+ * Allocate the jitter buffer, psram when present, otherwise internal ram
+ */
+void jitterBegin(void) {
+  jitterSize = JITTER_PSRAM_SIZE;
+  jitterBuf = (uint8_t*)heap_caps_malloc(jitterSize, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+
+  // no psram, settle for the biggest internal block we can get
+  if (!jitterBuf) jitterSize = JITTER_RAM_SIZE;
+  while (!jitterBuf && jitterSize >= JITTER_MIN_SIZE) {
+    jitterBuf = (uint8_t*)heap_caps_malloc(jitterSize, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!jitterBuf) jitterSize /= 2;
+  }
+  if (!jitterBuf) {
+    Serial.println(F("Jitter buffer allocation failed"));
+    jitterSize = 0;
+  }
+  else if (jitterSize != JITTER_PSRAM_SIZE) {
+    Serial.printf("Jitter buffer %u bytes internal ram\n", jitterSize);
+  }
+  else Serial.printf("Jitter buffer %u bytes psram\n", jitterSize);
+
+  jitterReset();
+}
+
+
+/*
+ * Empty the jitter buffer and go back to prefilling
+ */
+void jitterReset(void) {
+  jitterHead = jitterTail = jitterCount = 0;
+  jitterBuffering = true;
+  jitterSetBitrate(JITTER_DEFAULT_KBPS);
+}
+
+
+/*
+ * Convert the watermarks to bytes for the given stream bitrate
+ */
+void jitterSetBitrate(int kbps) {
+  // bytes = ms * kbit/s / 8, capped so the prefill mark is always reachable
+  const profile_t* p = &profiles[profileActive];
+  jitterKbps = kbps;
+  jitterPrefill = min((size_t)p->prefillMs * kbps / 8, jitterSize * 3 / 4);
+  jitterLow = min((size_t)p->lowMs * kbps / 8, jitterPrefill / 4);
+  if (kbps != JITTER_DEFAULT_KBPS) 
+    Serial.printf("Stream %d kbps, buffer holds %u ms\n", kbps, jitterSize * 8 / kbps);
+}
+
+
+/*
+ * Return the number of bytes waiting in the jitter buffer
+ */
+size_t jitterFill(void) {
+  return jitterCount;
+}
+
+
+/*
+ * Get the contiguous free region at the head of the jitter buffer
+ */
+size_t jitterWritePtr(uint8_t** ptr) {
+  *ptr = jitterBuf + jitterHead;
+  return min(jitterSize - jitterCount, jitterSize - jitterHead);
+}
+
+
+/*
+ * Mark len bytes written at the head of the jitter buffer
+ */
+void jitterCommit(size_t len) {
+  jitterHead = (jitterHead + len) % jitterSize;
+  jitterCount += len;
+}
+
+
+/*
+ * Copy len bytes in at the head, the caller has checked there is room
+ */
+void jitterPut(const uint8_t* data, size_t len) {
+  while (len > 0) {
+    uint8_t* span;
+    size_t n = min(len, jitterWritePtr(&span));
+    memcpy(span, data, n);
+    jitterCommit(n);
+    data += n;
+    len -= n;
+  }
+}
+
+
+/*
+ * Get the contiguous filled region at the tail of the jitter buffer
+ */
+size_t jitterReadPtr(uint8_t** ptr) {
+  *ptr = jitterBuf + jitterTail;
+  return min((size_t)jitterCount, jitterSize - jitterTail);
+}
+
+
+/*
+ * Release len bytes from the tail of the jitter buffer
+ */
+void jitterConsume(size_t len) {
+  jitterTail = (jitterTail + len) % jitterSize;
+  jitterCount -= len;
+}
+
+
+/*
+ * Build the gain curve, level 0 mutes and 100 is unity
+ */
+bool GainStage::begin(void) {
+  gainCurveBuild(gainCurve);
+  gain = target;
+  return true;
+}
+
+
+/*
+ * Take the stream format from the decoder and set up the output for it
+ */
+void GainStage::setAudioInfo(AudioInfo cfg) {
+  AudioStream::setAudioInfo(cfg);   // keep the channel count
+  clockUs = clockFrames = 0;        // frames of another rate
+  if (p_out == &i2s) outputConfigure(cfg);  // size the dma for the rate
+  else p_out->setAudioInfo(cfg);
+}
+
+
+/*
+ * Set the volume level, the change is ramped in over the next block
+ */
+void GainStage::setVolume(int level) {
+  target = gainCurve[constrain(level, 0, VOLUME_LEVELS-1)];
+}
+
+
+/*
+ * Scale a block of decoder pcm in place and pass it to i2s
+ */
+size_t GainStage::write(const uint8_t* data, size_t len) {
+  // The decoder hands over its own pcm buffer and does not read it again,
+  // so the gain is applied in place instead of into a copy.
+  int ch = (info.channels > 0) ? info.channels : 2;
+  apply((int16_t*)data, len / (ch * sizeof(int16_t)), ch);
+
+  // A blocking write leaves the dma full, so a gap longer than the dma
+  // holds means it ran dry and the speaker heard silence
+  int64_t start = esp_timer_get_time();
+  int rate = (info.sample_rate > 0) ? info.sample_rate : 44100;
+  if (lastOut && (start - lastOut) * rate > (int64_t)dmaFrames * 1000000) statUnderruns++;
+
+  // the pcm joins the end of what the dma holds, or starts it over
+  if (clockUs + (int64_t)clockFrames * 1000000 / rate <= start) {
+    clockUs = start;
+    clockFrames = 0;
+  }
+
+  // Straight through unless the drift controller wants a ratio, which is
+  // then kept up, at unity if need be, so the stream stays continuous
+  int32_t ppm = drift;
+  size_t in = len / (ch * sizeof(int16_t));
+  if (ch > RESAMPLE_CHANNELS || (ppm == 0 && stretch.pos == 0)) {
+    output(data, len);
+    clockFrames += in;
+  }
+  else {
+    const int16_t* pcm = (const int16_t*)data;
+    for (size_t f=0; f<in; f+=RESAMPLE_BLOCK) {
+      size_t n = resampleRun(&stretch, pcm + f * ch, min(in - f, (size_t)RESAMPLE_BLOCK), 
+                             ch, stretchBuf, ppm);
+      output((const uint8_t*)stretchBuf, n * ch * sizeof(int16_t));
+      clockFrames += n;
+    }
+  }
+  lastOut = esp_timer_get_time();
+  outUs += lastOut - start;
+  frames += len / (ch * sizeof(int16_t));
+  blocks++;
+  return len;
+}
+
+
+/*
+ * Return when the next frame written will be heard, esp_timer us
+ */
+int64_t GainStage::heardUs(void) {
+  int rate = (info.sample_rate > 0) ? info.sample_rate : 44100;
+  int64_t now = esp_timer_get_time();
+  int64_t end = clockUs + (int64_t)clockFrames * 1000000 / rate;
+  return max(end, now);  // an empty dma plays it at once
+}
+
+
+/*
+ * Hand pcm to the output, all of it
+ */
+void GainStage::output(const uint8_t* data, size_t len) {
+  // i2s may take the block in pieces, hand all of it over here so that
+  // nothing comes back to be scaled a second time
+  // waiting for dma room is no work, the clock may drop meanwhile
+  size_t done = 0;
+  pmBusy(false);
+  while (done < len) {
+    size_t n = p_out->write(data + done, len - done);
+    if (n == 0) vTaskDelay(1);  // dma is full
+    done += n;
+  }
+  pmBusy(true);
+}
+
+
+/*
+ * Apply the gain to interleaved 16 bit frames
+ */
+void GainStage::apply(int16_t* pcm, size_t frames, int ch) {
+  gainApply(pcm, frames, ch, &gain, target);
+}
+
+
+/*
+ * Switch the decoder stream to the decoder for a CODEC_xxx
+ */
+bool codecSelect(int codec) {
+  if (codec == audioCodec) return true;
+
+  AudioDecoder* decoder = NULL;
+  switch (codec) {
+    case CODEC_MP3: decoder = &mp3helix; break;
+    case CODEC_AAC: decoder = &aachelix; break;
+#if OGG_VORBIS
+    case CODEC_VORBIS: decoder = &vorbis; break;
+#endif
+#if OGG_OPUS
+    case CODEC_OPUS: decoder = &opus; break;
+#endif
+  }
+  if (!decoder) return false;
+
+  // end() frees the buffers of the old decoder before the new one
+  // allocates its own in begin()
+  if (audioCodec != CODEC_UNKNOWN) audioDecode.end();
+  audioDecode.setDecoder(decoder);
+  if (!audioDecode.begin()) {
+    audioCodec = CODEC_UNKNOWN;
+    return false;
+  }
+  audioCodec = codec;
+  Serial.printf("Decoder %d selected\n", codec);
+  return true;
+}
+
+
+/*
+ * Work out the CODEC_xxx from the first bytes of a stream
+ */
+int codecSniff(const uint8_t* data, size_t len) {
+  // the stream may start mid frame, so scan for the first sync
+  if (len >= 3 && memcmp(data, "ID3", 3) == 0) return CODEC_MP3;
+  for (size_t i=0; i+4 <= len; i++) {
+    const uint8_t* p = data + i;
+    if (memcmp(p, "OggS", 4) == 0) {
+      // the first page names the codec, wait until it is all here
+      if (len - i < 64) return CODEC_UNKNOWN;
+      if (memmem(p, len - i, "OpusHead", 8)) return OGG_OPUS ? CODEC_OPUS : CODEC_NONE;
+      if (memmem(p, len - i, "\x01vorbis", 7)) return OGG_VORBIS ? CODEC_VORBIS : CODEC_NONE;
+      return CODEC_NONE;  // flac or something else in ogg
+    }
+    if (p[0] != 0xFF) continue;
+    if ((p[1] & 0xF6) == 0xF0) return CODEC_AAC;  // adts sync, layer 0
+    if ((p[1] & 0xE0) == 0xE0 && (p[1] & 0x06) &&  // mpeg sync, layer 1..3
+        (p[2] >> 4) != 0x0F && ((p[2] >> 2) & 3) != 3) return CODEC_MP3;
+  }
+  return CODEC_UNKNOWN;
+}
+
+
+/*
+ * Map a Content-Type to a CODEC_xxx, CODEC_UNKNOWN when it has to be sniffed
+ */
+int codecFromType(const char* type) {
+  struct {
+    const char* type;
+    int codec;
+  } types[] = {
+    {"audio/mpeg", CODEC_MP3}, {"audio/mp3", CODEC_MP3}, {"audio/mpeg3", CODEC_MP3},
+    {"audio/aac", CODEC_AAC}, {"audio/aacp", CODEC_AAC}, {"audio/x-aac", CODEC_AAC},
+    {"audio/vorbis", OGG_VORBIS ? CODEC_VORBIS : CODEC_NONE},
+    {"audio/opus", OGG_OPUS ? CODEC_OPUS : CODEC_NONE},
+    {"audio/ogg", CODEC_UNKNOWN}, {"application/ogg", CODEC_UNKNOWN},
+    {"application/octet-stream", CODEC_UNKNOWN}, {"audio/x-scpls", CODEC_UNKNOWN},
+    {"audio/scpls", CODEC_UNKNOWN}, {"application/pls+xml", CODEC_UNKNOWN},
+    {"audio/x-mpegurl", CODEC_UNKNOWN}, {"audio/mpegurl", CODEC_UNKNOWN},
+    {"application/x-mpegurl", CODEC_UNKNOWN}, {"application/vnd.apple.mpegurl", CODEC_UNKNOWN}
+  };
+  for (size_t i=0; i<sizeof(types)/sizeof(types[0]); i++)
+    if (strcasecmp(type, types[i].type) == 0) return types[i].codec;
+  return CODEC_NONE;  // flac, wav, html error pages and the like
+}
+
+
+/*
+ * Set the output up for the format of the first frame, before its pcm
+ */
+void syncAnnounce(sync_t* info, size_t dropped) {
+  Serial.printf("Frame sync after %u bytes: %d Hz, %d ch, %d kbps\n",
+                (unsigned)dropped, info->rate, info->channels, info->kbps);
+  if (info->rate == 0) return;  // aac, the decoder tells
+  // the decoder's own setAudioInfo() then finds nothing changed, so i2s
+  // is not restarted under the first pcm
+  AudioInfo cfg;
+  cfg.sample_rate = info->rate;
+  cfg.channels = info->channels;
+  cfg.bits_per_sample = 16;
+  volume.setAudioInfo(cfg);
+}
+
+
+/*
+ * Bitrate of the stream in kbps from the decoder, 0 until it is known
+ */
+int codecBitrate(void) {
+  switch (audioCodec) {
+    case CODEC_MP3: return mp3helix.audioInfoEx().bitrate / 1000;
+    case CODEC_AAC: return aachelix.audioInfoEx().bitRate / 1000;
+  }
+  return 0;  // ogg decoders do not say, the default marks stay
+}
+
+
+/*
+ * Hand encoded bytes to the decoder and time the frames it produces
+ */
+size_t decodeWrite(const uint8_t* data, size_t len) {
+  int64_t start = esp_timer_get_time();
+  uint32_t outUs = volume.outUs;
+  uint32_t blocks = volume.blocks;
+  pmBusy(true);
+  len = audioDecode.write(data, len);
+  pmBusy(false);
+
+  // the decode time is what is left once the i2s waits are taken out,
+  // a write that holds no complete frame carries over to the next
+  decodeCarryUs += (esp_timer_get_time() - start) - (volume.outUs - outUs);
+  if (volume.blocks != blocks) {
+    statsAdd(&statDecode, decodeCarryUs / (volume.blocks - blocks));
+    decodeCarryUs = 0;
+  }
+  return len;
+}
+
+
+/*
+ * Forbid allocations by the calling task until called with false,
+ * returns whether they were forbidden. Does nothing unless HEAP_GUARD.
+ */
+bool heapGuard(bool on) {
+#if HEAP_GUARD
+  bool was = heapGuardTask != NULL;
+  heapGuardTask = on ? xTaskGetCurrentTaskHandle() : NULL;
+  return was;
+#else
+  return false;
+#endif
+}
+
+
+#if HEAP_GUARD
+extern "C" {
+void* __real_malloc(size_t);
+void* __real_calloc(size_t, size_t);
+void* __real_realloc(void*, size_t);
+
+/*
+ * Stop the unit when the guarded task allocates
+ */
+void heapGuardCheck(size_t size, void* caller) {
+  if (!heapGuardTask || xTaskGetCurrentTaskHandle() != heapGuardTask) return;
+  heapGuardTask = NULL;
+  // ets_printf goes straight to the uart, so it does not allocate
+  ets_printf("\nHEAP GUARD: %u bytes allocated in the steady path, caller %p\n",
+             (unsigned)size, caller);
+  abort();
+}
+
+void* __wrap_malloc(size_t n) {
+  heapGuardCheck(n, __builtin_return_address(0));
+  return __real_malloc(n);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+  heapGuardCheck(n * size, __builtin_return_address(0));
+  return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* old, size_t n) {
+  heapGuardCheck(n, __builtin_return_address(0));
+  return __real_realloc(old, n);
+}
+}
+#endif
+
+
+#if REPLAY_CAPTURES
+/*
+ * Decode every capture in LittleFS into a null sink and report on each
+ */
+void replayCaptures(void) {
+  // The same chain as a live stream minus the network and i2s, so the
+  // figures line up with bench/bench.cpp on the desktop. Upload the
+  // captures from data/ with: pio run -e esp32replay -t uploadfs
+  if (!LittleFS.begin()) {
+    Serial.println(F("Replay: no LittleFS"));
+    return;
+  }
+  uint8_t* buf = (uint8_t*)malloc(JITTER_CHUNK);
+  if (!buf) return;
+  volume.setOutput(replaySink);
+
+  File dir = LittleFS.open("/");
+  for (File f = dir.openNextFile(); f; f = dir.openNextFile()) {
+    size_t got = f.read(buf, JITTER_CHUNK);
+    int codec = codecSniff(buf, got);
+    if (codec <= CODEC_UNKNOWN || !codecSelect(codec)) {
+      Serial.printf("Replay %s: unsupported\n", f.name());
+      continue;
+    }
+    memset(&statDecode, 0, sizeof(statDecode));
+    decodeCarryUs = 0;
+    uint32_t frames = volume.frames;
+    uint32_t heapLow = esp_get_free_heap_size();
+    size_t bytes = 0;
+    int64_t start = esp_timer_get_time();
+    while (got > 0) {
+      for (size_t done = 0; done < got; ) {
+        size_t n = decodeWrite(buf + done, got - done);
+        if (n == 0) break;  // decoder refused it, the rest of the chunk goes
+        done += n;
+      }
+      bytes += got;
+      heapLow = min(heapLow, esp_get_free_heap_size());
+      got = f.read(buf, JITTER_CHUNK);
+    }
+    float secs = (esp_timer_get_time() - start) / 1e6f;
+    int rate = volume.audioInfo().sample_rate;
+    float played = (float)(volume.frames - frames) / (rate > 0 ? rate : 44100);
+    Serial.printf("Replay %s: %u bytes, %.1f s of audio in %.2f s, %.1fx real time\n",
+      f.name(), (unsigned)bytes, played, secs, (secs > 0) ? played / secs : 0.0f);
+    Serial.printf("  decode us/frame: mean %u max %u over %u frames, heap low %u\n",
+      statDecode.count ? (unsigned)(statDecode.sum / statDecode.count) : 0,
+      (unsigned)statDecode.max, (unsigned)statDecode.count, (unsigned)heapLow);
+  }
+
+  // leave things as a live stream expects them
+  audioDecode.end();
+  audioCodec = CODEC_UNKNOWN;
+  volume.setOutput(i2s);
+  volume.idle();
+  memset(&statDecode, 0, sizeof(statDecode));
+  statUnderruns = 0;
+  free(buf);
+}
+#endif
+
+
+/*
+ * Start the byte rate window over
+ */
+void rateReset(void) {
+  memset(rateBytes, 0, sizeof(rateBytes));
+  memset(rateFull, 0, sizeof(rateFull));
+  rateIndex = 0;
+  rateFilled = 0;
+  rateStart = millis();
+}
+
+
+/*
+ * Count stream bytes into the window, full when the jitter buffer had no room
+ */
+void rateAdd(size_t bytes, bool full) {
+  unsigned long now = millis();
+  if (now - rateStart >= (unsigned long)RATE_BUCKET_MS * RATE_BUCKETS) {
+    // nothing counted for a whole window
+    memset(rateBytes, 0, sizeof(rateBytes));
+    memset(rateFull, 0, sizeof(rateFull));
+    rateStart = now;
+    rateFilled = RATE_BUCKETS;
+  }
+  while (now - rateStart >= RATE_BUCKET_MS) {
+    rateStart += RATE_BUCKET_MS;
+    rateIndex = (rateIndex + 1) % RATE_BUCKETS;
+    rateBytes[rateIndex] = 0;
+    rateFull[rateIndex] = false;
+    if (rateFilled < RATE_BUCKETS) rateFilled++;
+  }
+  rateBytes[rateIndex] += bytes;
+  rateFull[rateIndex] |= full;
+}
+
+
+/*
+ * Return true if the window carried too little of a kbps stream
+ */
+bool rateStalled(int kbps) {
+  // a full jitter buffer holds the server off, that is not a stall
+  if (rateFilled < RATE_BUCKETS) return false;
+  uint32_t bytes = 0;
+  for (int i=0; i<RATE_BUCKETS; i++) {
+    if (rateFull[i]) return false;
+    bytes += rateBytes[i];
+  }
+  uint32_t expect = (uint32_t)kbps * RATE_BUCKET_MS * RATE_BUCKETS / 8;  // bytes
+  return bytes * 100 < expect * STALL_PERCENT;
+}
+
+
+/*
+ * Reconnect delay for an attempt, doubling each time, give or take a quarter
+ */
+unsigned long retryDelay(int attempt) {
+  // the spread keeps a room full of players from hitting a server in step
+  unsigned long wait = min((unsigned long)RETRY_BASE_MS << min(attempt, 15), 
+                           (unsigned long)RETRY_MAX_MS);
+  return wait * 3 / 4 + esp_random() % (wait / 2 + 1);
+}
+
+
+/*
+ * Add a sample to a log2 histogram
+ */
+void statsAdd(hist_t* hist, uint32_t value) {
+  int bin = value ? 32 - __builtin_clz(value) : 0;  // 1 is bin 1, 2-3 bin 2 ...
+  statsAddBin(hist, bin, value);
+}
+
+
+/*
+ * Add a sample to a histogram bin of the caller's choosing
+ */
+void statsAddBin(hist_t* hist, int bin, uint32_t value) {
+  hist->bins[min(bin, STATS_BINS-1)]++;
+  hist->count++;
+  hist->sum += value;
+  if (value > hist->max) hist->max = value;
+}
+
+
+/*
+ * Count stream bytes, one rate sample per second
+ */
+void statsNet(size_t bytes) {
+  statNetBytes += bytes;
+  statNetSecond += bytes;
+  if (millis() - statNetStart >= 1000) {
+    if (statNetStart) statsAdd(&statNetRate, statNetSecond);
+    statNetSecond = 0;
+    statNetStart = millis();
+  }
+}
+
+
+/*
+ * Write the statistics as json, returns the length
+ */
+size_t statsJson(char* buf, size_t size) {
+  size_t len = snprintf(buf, size,
+    "{\"uptime_ms\":%lu,"
+    "\"boot_ms\":{\"wifi\":%u,\"stream\":%u,\"audio\":%u},"
+    "\"heap\":{\"free\":%u,\"min_free\":%u,\"largest_block\":%u},"
+    "\"stream\":{\"state\":%d,\"bytes\":%u,\"stalls\":%u,\"reconnects\":%u,"
+    "\"rebuffers\":%u,\"underruns\":%u,\"frames\":%u,\"jitter_size\":%u},"
+    "\"output\":{\"profile\":\"%s\",\"active\":\"%s\",\"rate\":%d,\"dma_frames\":%d,"
+    "\"drift_ppm\":%d},"
+    "\"room\":{\"role\":\"%s\",\"lost\":%u,\"dropped\":%u,\"resyncs\":%u,"
+    "\"error_us\":%d},"
+    "\"shift\":{\"state\":\"%s\",\"behind_ms\":%u,\"lost\":%u},"
+    "\"input_lost\":%u,",
+    millis(), 
+    (unsigned)(bootWifiUs / 1000), (unsigned)(bootConnUs / 1000), (unsigned)(bootPcmUs / 1000),
+    (unsigned)esp_get_free_heap_size(), (unsigned)esp_get_minimum_free_heap_size(),
+    (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT),
+    audioState, (unsigned)statNetBytes, (unsigned)streamStalls, 
+    (unsigned)streamReconnects, (unsigned)statRebuffers, (unsigned)statUnderruns,
+    (unsigned)volume.blocks, (unsigned)jitterSize,
+    profiles[outputProfile].name, profiles[profileActive].name,
+    outputConfig.sample_rate, outputConfig.buffer_count * outputConfig.buffer_size,
+    driftPpm, roomNames[roomMode], (unsigned)roomLost, (unsigned)roomDropped,
+    (unsigned)roomResyncs, roomErrUs, shiftNames[shiftState],
+    (unsigned)((uint64_t)shiftBehind * 8 / jitterKbps), (unsigned)shiftLost,
+    (unsigned)inputLost);
+  len += statsHist(buf + min(len, size), size - min(len, size), "net_bytes_per_s", &statNetRate);
+  len += statsHist(buf + min(len, size), size - min(len, size), "fill_tenths", &statFill);
+  len += statsHist(buf + min(len, size), size - min(len, size), "decode_us_per_frame", &statDecode);
+  len += statsHist(buf + min(len, size), size - min(len, size), "loop_us", &statLoop);
+  if (len < size) buf[len - 1] = '}';  // replaces the trailing comma
+  return min(len, size - 1);
+}
+
+
+/*
+ * Write one histogram as a json member followed by a comma
+ */
+size_t statsHist(char* buf, size_t size, const char* name, hist_t* hist) {
+  size_t len = snprintf(buf, size, "\"%s\":{\"count\":%u,\"mean\":%u,\"max\":%u,\"bins\":[",
+    name, (unsigned)hist->count, 
+    (unsigned)(hist->count ? hist->sum / hist->count : 0), (unsigned)hist->max);
+  for (int i=0; i<STATS_BINS; i++) 
+    len += snprintf(buf + min(len, size), size - min(len, size), 
+                    i < STATS_BINS-1 ? "%u," : "%u]},", (unsigned)hist->bins[i]);
+  return len;
+}
+
+
+/*
+ * Dump the statistics over serial
+ */
+void statsPrint(void) {
+  char* json = (char*)malloc(STATS_JSON_SIZE);
+  if (!json) return;
+  statsJson(json, STATS_JSON_SIZE);
+  Serial.println(json);
+  free(json);
+}
+
+
+/*
+ * Turn on frequency scaling and automatic light sleep
+ */
+void pmBegin(void) {
+  esp_pm_config_esp32_t pm;
+  pm.max_freq_mhz = PM_CPU_MAX_MHZ;
+  pm.min_freq_mhz = PM_CPU_MIN_MHZ;
+  pm.light_sleep_enable = PM_LIGHT_SLEEP;
+  esp_err_t err = esp_pm_configure(&pm);
+  if (err != ESP_OK && pm.light_sleep_enable) {
+    // the core lacks tickless idle, scale the clock only
+    pm.light_sleep_enable = false;
+    err = esp_pm_configure(&pm);
+  }
+  if (err != ESP_OK) {
+    Serial.printf("Power management off: %s\n", esp_err_to_name(err));
+    return;
+  }
+  esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "decode", &pmDecodeLock);
+
+  // light sleep stops the gpio isrs, let the knob, the button and the
+  // portal switch wake the chip, on whichever level their isrs are waiting
+  // for. The turn that wakes it may lose its first detent.
+  if (pm.light_sleep_enable) {
+    gpio_wakeup_enable((gpio_num_t)ROTARY_ENCODER_A_PIN, GPIO_INTR_LOW_LEVEL);
+    gpio_wakeup_enable((gpio_num_t)ROTARY_ENCODER_B_PIN, GPIO_INTR_LOW_LEVEL);
+    gpio_wakeup_enable((gpio_num_t)ROTARY_ENCODER_BUTTON_PIN, GPIO_INTR_LOW_LEVEL);
+    gpio_wakeup_enable((gpio_num_t)PORTAL_PIN, GPIO_INTR_LOW_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+  }
+  Serial.printf("Power management: %d-%d MHz, light sleep %s\n", 
+    PM_CPU_MIN_MHZ, PM_CPU_MAX_MHZ, pm.light_sleep_enable ? "on" : "off");
+}
+
+
+/*
+ * Hold the full cpu clock while there is decoding to do
+ */
+void pmBusy(bool busy) {
+  // locks count, so every true needs its false
+  if (!pmDecodeLock) return;
+  if (busy) esp_pm_lock_acquire(pmDecodeLock);
+  else esp_pm_lock_release(pmDecodeLock);
+}
+
+
+/*
+ * Start or stop the i2s dma
+ */
+void outputRun(bool on) {
+  // stopped, i2s gives up its clock lock and the chip may light-sleep
+  if (on == outputOn) return;
+  if (on) i2s.begin(outputConfig);
+  else i2s.end();
+  outputOn = on;
+  volume.idle();  // the gap is not an underrun
+}
+
+
+/*
+ * Derive the i2s configuration from the stream format and the profile
+ */
+void outputConfigure(AudioInfo info) {
+  const profile_t* p = &profiles[profileActive];
+  I2SConfig cfg = i2s.defaultConfig(TX_MODE);
+  cfg.pin_bck = I2S_PIN_BCK;
+  cfg.pin_ws = I2S_PIN_WS;
+  cfg.pin_data = I2S_PIN_DATA;
+  cfg.sample_rate = (info.sample_rate > 0) ? info.sample_rate : DMA_DEFAULT_RATE;
+  cfg.channels = (info.channels > 0) ? info.channels : 2;
+  cfg.bits_per_sample = (info.bits_per_sample > 0) ? info.bits_per_sample : 16;
+
+  // the fewest buffers the driver allows that hold the profile's audio
+  int dmaMs = p->dmaMs;
+  if (roomMode == ROOM_LEADER) dmaMs = max(dmaMs, ROOM_LEAD_MS);  // time to get the packets out
+  if (roomMode == ROOM_FOLLOWER) dmaMs = profiles[PROFILE_LOW].dmaMs;
+  int frames = cfg.sample_rate * dmaMs / 1000;
+  cfg.buffer_count = constrain((frames + DMA_FRAMES_MAX - 1) / DMA_FRAMES_MAX, 
+                               DMA_BUFFERS_MIN, DMA_BUFFERS_MAX);
+  cfg.buffer_size = constrain(frames / cfg.buffer_count, DMA_FRAMES_MIN, DMA_FRAMES_MAX);
+
+  bool begun = outputConfig.buffer_count > 0;
+  if (begun && cfg.sample_rate == outputConfig.sample_rate &&
+      cfg.channels == outputConfig.channels &&
+      cfg.bits_per_sample == outputConfig.bits_per_sample &&
+      cfg.buffer_count == outputConfig.buffer_count &&
+      cfg.buffer_size == outputConfig.buffer_size) return;  // nothing changed
+  outputConfig = cfg;
+  volume.setDmaFrames(cfg.buffer_count * cfg.buffer_size);  // for underruns
+  Serial.printf("Output %s: %d Hz, dma %d x %d frames, %d ms\n", p->name,
+    cfg.sample_rate, cfg.buffer_count, cfg.buffer_size,
+    cfg.buffer_count * cfg.buffer_size * 1000 / cfg.sample_rate);
+  if (!outputOn) return;  // outputRun() begins it
+  bool guarded = heapGuard(false);  // the driver is installed afresh
+  if (begun) i2s.end();
+  i2s.begin(cfg);
+  heapGuard(guarded);
+  volume.idle();  // the restart is not an underrun
+}
+
+
+/*
+ * New stream, forget the set point and the ratio of the last one
+ */
+void driftReset(void) {
+  driftPlaying = 0;
+  driftTarget = -1;
+  driftSum = 0;
+  driftPpm = 0;
+  volume.setDrift(0);
+}
+
+
+/*
+ * One step of the drift controller, audio task only
+ */
+void driftStep(bool playing) {
+  unsigned long now = millis();
+  if (!playing) {
+    driftAt = 0;  // rebuffering or reconnecting, that is not drift
+    return;
+  }
+  if (driftAt && now - driftAt < DRIFT_PERIOD_MS) return;
+  float fill = (float)jitterCount * 8 / jitterKbps;  // ms of audio held
+  if (!driftAt) {
+    driftAt = now;
+    driftFill = fill;  // pick up where the stream is
+    return;
+  }
+  driftPlaying += now - driftAt;
+  driftAt = now;
+  driftFill += (fill - driftFill) / DRIFT_SMOOTH;
+  if (driftTarget < 0) {
+    if (driftPlaying < DRIFT_SETTLE_MS) return;
+    // hold the settled fill, but leave room above it
+    driftTarget = min(driftFill, (float)jitterSize * 3 / 4 * 8 / jitterKbps);
+    Serial.printf("Drift: holding the buffer at %d ms\n", (int)driftTarget);
+  }
+
+  // fuller than the set point, so the station runs fast, play faster
+  float err = driftFill - driftTarget;
+  driftSum = constrain(driftSum + DRIFT_KI * err, (float)-DRIFT_MAX_PPM, (float)DRIFT_MAX_PPM);
+  int ppm = constrain((int)lroundf(DRIFT_KP * err + driftSum), -DRIFT_MAX_PPM, DRIFT_MAX_PPM);
+  if (ppm != driftPpm) volume.setDrift(ppm);
+  driftPpm = ppm;
+}
+
+
+/*
+ * Select the output profile, from loop(), and keep it in settings
+ */
+void profileSet(int profile) {
+  outputProfile = constrain(profile, 0, PROFILE_COUNT-1);
+  settingPut(profileKey, outputProfile);
+  audioSend(AUDIO_CMD_PROFILE, outputProfile);
+  Serial.printf("Profile %s\n", profiles[outputProfile].name);
+}
+
+
+/*
+ * Put a profile to use, audio task only
+ */
+void profileSelect(int profile) {
+  profileActive = (profile == PROFILE_ROBUST) ? PROFILE_ROBUST : PROFILE_LOW;
+  profileRebuffers = statRebuffers;
+  profileUnderruns = statUnderruns;
+  jitterSetBitrate(jitterKbps);      // marks of the new profile
+  outputConfigure(volume.audioInfo()); // and its dma, for the current format
+}
+
+
+/*
+ * Auto profile, go robust once the station has run dry
+ */
+void profileWatch(void) {
+  if (outputProfile != PROFILE_AUTO || profileActive == PROFILE_ROBUST) return;
+  if (statRebuffers == profileRebuffers && statUnderruns == profileUnderruns) return;
+  Serial.println(F("Profile auto: weak link, going robust"));
+  profileSelect(PROFILE_ROBUST);
+}
+
+
+/*
+ * Serve /profile, POST mode=auto|low|robust sets it, answers the profile in use
+ */
+void profileHandle(AsyncWebServerRequest* request) {
+  if (!portalGate(request)) return;
+  int profile = outputProfile;
+  const AsyncWebParameter* param = webArg(request, "mode");
+  if (param) {
+    const String& mode = param->value();
+    int i = 0;
+    while (i < PROFILE_COUNT && strcmp(mode.c_str(), profiles[i].name) != 0) i++;
+    if (i == PROFILE_COUNT) {
+      request->send(400, "text/plain", "mode is auto, low or robust");
+      return;
+    }
+    if (!webPost(WEB_PROFILE, i)) {
+      request->send(503, "text/plain", "Busy, try again");
+      return;
+    }
+    profile = i;  // loop() sets it in a moment
+  }
+  char json[64];
+  snprintf(json, sizeof(json), "{\"profile\":\"%s\",\"active\":\"%s\"}", 
+           profiles[profile].name, profiles[profileActive].name);
+  request->send(200, "application/json", json);
+}
+
+
+/*
+ * Serve GET /probes, the health of each station in list order
+ */
+void probesHandle(AsyncWebServerRequest* request) {
+  // the render state lives in the callback, freed along with the response
+  probesPage_t page;
+  page.station = -1;
+  page.len = page.sent = 0;
+  request->send(request->beginChunkedResponse("application/json",
+    [page](uint8_t* buf, size_t maxLen, size_t index) mutable -> size_t {
+      return probesChunk(&page, buf, maxLen);
+    }));
+}
+
+
+/*
+ * Fill the next part of the /probes reply, 0 when it is all out
+ */
+size_t probesChunk(probesPage_t* page, uint8_t* buf, size_t maxLen) {
+  size_t n = 0;
+  while (n < maxLen) {
+    if (page->sent == page->len) {
+      if (page->station > stationLive->count) break;  // the tail is out
+      probesLine(page);
+    }
+    size_t part = min(maxLen - n, page->len - page->sent);
+    memcpy(buf + n, page->line + page->sent, part);
+    page->sent += part;
+    n += part;
+  }
+  return n;
+}
+
+
+/*
+ * Render the next station of the /probes reply into the page line
+ */
+void probesLine(probesPage_t* page) {
+  char* line = page->line;
+  size_t size = sizeof(page->line);
+  int i = page->station++;
+  int len;
+  if (i < 0) len = snprintf(line, size, "[");
+  else if (i < stationLive->count) {
+    const char* url = streamsGetUrl(i);
+    probe_t* p = probeFind(crc32((const uint8_t*)url, strlen(url)), false);
+    len = snprintf(line, size, "%s{\"station\":%d", i ? "," : "", i+1);
+    if (p) len += snprintf(line + len, size - len,
+      ",\"connect_ms\":%u,\"status\":%d,\"kbps\":%u,\"codec\":%u,\"fails\":%u,"
+      "\"age_s\":%ld,\"dead\":%s",
+      p->connectMs, p->status, p->kbps, p->codec, p->fails,
+      p->at ? (long)((millis() - p->at) / 1000) : -1L,
+      p->fails >= PROBE_DEAD_FAILS ? "true" : "false");
+    len += snprintf(line + len, size - len, "}");
+  }
+  else len = snprintf(line, size, "]");
+  page->len = min((size_t)len, size - 1);
+  page->sent = 0;
+}
+
+
+/*
+ * Open the multi-room socket for roomMode, audio task only
+ */
+bool roomOpen(void) {
+  roomSock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (roomSock < 0) return false;
+  fcntl(roomSock, F_SETFL, fcntl(roomSock, F_GETFL, 0) | O_NONBLOCK);
+  memset(&roomAddr, 0, sizeof(roomAddr));
+  roomAddr.sin_family = AF_INET;
+  roomAddr.sin_port = htons(ROOM_PORT);
+  roomAddr.sin_addr.s_addr = inet_addr(ROOM_GROUP);
+
+  if (roomMode == ROOM_LEADER) {
+    uint8_t ttl = 1;  // stay on the local network
+    setsockopt(roomSock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    return true;
+  }
+
+  struct sockaddr_in any;
+  memset(&any, 0, sizeof(any));
+  any.sin_family = AF_INET;
+  any.sin_port = htons(ROOM_PORT);
+  any.sin_addr.s_addr = htonl(INADDR_ANY);
+  struct ip_mreq join;
+  join.imr_multiaddr.s_addr = roomAddr.sin_addr.s_addr;
+  join.imr_interface.s_addr = htonl(INADDR_ANY);
+  if (bind(roomSock, (struct sockaddr*)&any, sizeof(any)) < 0 ||
+      setsockopt(roomSock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &join, sizeof(join)) < 0) {
+    roomClose();
+    return false;
+  }
+  esp_wifi_set_ps(WIFI_PS_NONE);  // modem sleep holds multicast until a dtim beacon
+  return true;
+}
+
+
+/*
+ * Leave the group
+ */
+void roomClose(void) {
+  if (roomSock < 0) return;
+  if (roomMode == ROOM_FOLLOWER) esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+  close(roomSock);
+  roomSock = -1;
+}
+
+
+/*
+ * Set up the role for a new stream, true when it is followed, not fetched
+ */
+bool roomBegin(void) {
+  roomClose();
+  if (roomMode == ROOM_SOLO) return false;
+  if (!roomOpen()) {
+    Serial.println(F("Room: no socket, playing alone"));
+    roomMode = ROOM_SOLO;
+    return false;
+  }
+  if (roomMode == ROOM_LEADER) {
+    roomEpoch++;  // the followers drop what they hold
+    return false;
+  }
+  roomJoined = false;
+  roomRestart();
+  audioConn.state = CONN_BUFFERING;
+  return true;
+}
+
+
+/*
+ * Follower, forget the chunks held and wait for the timeline again
+ */
+void roomRestart(void) {
+  jitterReset();
+  roomMarkHead = roomMarkCount = 0;
+  roomRunning = false;
+  roomErr = roomSum = 0;
+  driftPpm = 0;
+  volume.setDrift(0);
+  volume.idle();
+}
+
+
+/*
+ * Leader, multicast a chunk the decoder has taken
+ */
+void roomSend(const uint8_t* data, size_t len, int64_t heardUs) {
+  if (roomSock < 0 || len == 0) return;
+  roomPacket.sendUs = esp_timer_get_time();
+  roomPacket.playUs = heardUs;
+  roomPacket.magic = ROOM_MAGIC;
+  roomPacket.seq = roomSeq++;
+  roomPacket.epoch = roomEpoch;
+  roomPacket.len = len;
+  roomPacket.codec = audioCodec;
+  memcpy(roomPacket.data, data, len);
+  // best effort, a full send queue just loses the packet
+  sendto(roomSock, &roomPacket, ROOM_HEADER + len, 0, 
+         (struct sockaddr*)&roomAddr, sizeof(roomAddr));
+}
+
+
+/*
+ * Follower, move arrived packets into the jitter buffer, true if any came
+ */
+bool roomReceive(void) {
+  bool got = false;
+  int n;
+  while ((n = recv(roomSock, &roomPacket, sizeof(roomPacket), 0)) > 0) {
+    int64_t now = esp_timer_get_time();
+    roomPacket_t* pkt = &roomPacket;
+    if (n < (int)ROOM_HEADER || pkt->magic != ROOM_MAGIC || 
+        pkt->len > JITTER_CHUNK || n < (int)(ROOM_HEADER + pkt->len)) continue;
+    got = true;
+
+    if (!roomJoined || pkt->epoch != roomEpoch) {
+      // the leader changed station, start on the new one
+      roomRestart();
+      roomJoined = true;
+      roomEpoch = pkt->epoch;
+      roomSeq = pkt->seq;
+      if (audioCodec != CODEC_UNKNOWN) audioDecode.end();  // drop the old frames
+      audioCodec = CODEC_UNKNOWN;
+    }
+    if ((int32_t)(pkt->seq - roomSeq) < 0) continue;  // late duplicate
+    roomLost += pkt->seq - roomSeq;
+    roomSeq = pkt->seq + 1;
+    if (pkt->codec != audioCodec && !codecSelect(pkt->codec)) continue;
+
+    // the least delay seen is the closest to the clock offset
+    roomOffsetNext = min(roomOffsetNext, now - pkt->sendUs);
+    roomOffset = min(roomOffsetLast, roomOffsetNext);
+    if (++roomOffsetCount >= ROOM_OFFSET_PACKETS) {
+      roomOffsetLast = roomOffsetNext;  // follow the clocks as they wander
+      roomOffsetNext = INT64_MAX;
+      roomOffsetCount = 0;
+    }
+
+    if (roomMarkCount == ROOM_MARKS || jitterSize - jitterCount < pkt->len) {
+      roomDropped++;
+      continue;
+    }
+    jitterPut(pkt->data, pkt->len);
+    roomMark_t* m = &roomMarks[(roomMarkHead + roomMarkCount++) % ROOM_MARKS];
+    m->playUs = pkt->playUs;
+    m->len = pkt->len;
+  }
+  return got;
+}
+
+
+/*
+ * Follower, decode the oldest chunk when its time has come
+ */
+bool roomFeed(void) {
+  if (!roomMarkCount || audioCodec == CODEC_UNKNOWN) return false;
+  roomMark_t* m = &roomMarks[roomMarkHead];
+  int64_t err = volume.heardUs() - (m->playUs + roomOffset);  // > 0 heard late
+  bool skip = false;
+  if (!roomRunning) {
+    if (err < 0) return false;  // wait for its time
+    if (err > ROOM_LATE_MS * 1000) skip = true;  // missed it, try the next
+    else roomRunning = true;
+  }
+  else if (err > ROOM_RESYNC_MS * 1000) skip = true;  // behind, catch up
+  else if (err < -ROOM_RESYNC_MS * 1000) {
+    // ahead, let the dma play out and start again on time
+    roomRestart();
+    roomResyncs++;
+    return false;
+  }
+  else roomSteer(err);
+
+  // skipped bytes leave the decoder to find the next frame header
+  if (skip) roomDropped++;
+  size_t left = m->len;
+  uint8_t* span;
+  while (left) {
+    size_t len = min(jitterReadPtr(&span), left);
+    if (!skip) decodeWrite(span, len);
+    jitterConsume(len);
+    left -= len;
+  }
+  roomMarkHead = (roomMarkHead + 1) % ROOM_MARKS;
+  roomMarkCount--;
+  return true;
+}
+
+
+/*
+ * Follower, resample to close on the leader's timeline
+ */
+void roomSteer(int64_t errUs) {
+  // heard late, so play faster
+  roomErrUs = errUs;
+  roomErr += (errUs / 1000.0f - roomErr) / ROOM_SMOOTH;
+  roomSum = constrain(roomSum + ROOM_KI * roomErr, (float)-DRIFT_MAX_PPM, (float)DRIFT_MAX_PPM);
+  int ppm = constrain((int)lroundf(ROOM_KP * roomErr + roomSum), -DRIFT_MAX_PPM, DRIFT_MAX_PPM);
+  if (ppm != driftPpm) volume.setDrift(ppm);
+  driftPpm = ppm;
+}
+
+
+/*
+ * Follower, one pass of the audio task, true if anything moved
+ */
+bool roomFollow(void) {
+  bool moved = roomReceive();
+  if (roomFeed()) moved = true;
+  int state = roomRunning ? CONN_PLAYING : CONN_BUFFERING;
+  if (audioConn.state != state) {
+    audioConn.state = state;
+    audioState = state;
+    loopWake();  // show the new phase now
+  }
+  return moved;
+}
+
+
+/*
+ * Select the multi-room role, from loop(), and keep it in settings
+ */
+void roomSet(int role) {
+  roomRole = constrain(role, 0, ROOM_COUNT-1);
+  settingPut(roomKey, roomRole);
+  Serial.printf("Room %s\n", roomNames[roomRole]);
+  if (systemStreaming) audioSend(AUDIO_CMD_PLAY, currentIndex);  // start over in it
+}
+
+
+/*
+ * Serve /room, POST mode=solo|leader|follower sets it, answers the role
+ */
+void roomHandle(AsyncWebServerRequest* request) {
+  if (!portalGate(request)) return;
+  int role = roomRole;
+  const AsyncWebParameter* param = webArg(request, "mode");
+  if (param) {
+    const String& mode = param->value();
+    int i = 0;
+    while (i < ROOM_COUNT && strcmp(mode.c_str(), roomNames[i]) != 0) i++;
+    if (i == ROOM_COUNT) {
+      request->send(400, "text/plain", "mode is solo, leader or follower");
+      return;
+    }
+    if (!webPost(WEB_ROOM, i)) {
+      request->send(503, "text/plain", "Busy, try again");
+      return;
+    }
+    role = i;  // loop() sets it in a moment
+  }
+  char json[64];
+  snprintf(json, sizeof(json), "{\"room\":\"%s\"}", roomNames[role]);
+  request->send(200, "application/json", json);
+}
+
+
+/*
+ * Block loop() until its nearest timer is due, or loopWake() ends it early
+ */
+void loopWait(void) {
+  // The isrs and the serial callback latch their input, so the cpu sleeps
+  // for as long as there is nothing due instead of spinning
+  TickType_t wait = portMAX_DELAY;
+  unsigned long now = millis();
+  for (int i=0; i<TIMER_COUNT; i++) {
+    if (!loopTimers[i].armed) continue;
+    long left = (long)(loopTimers[i].due - now);
+    if (left <= 0) return;                   // one is due already
+    TickType_t ticks = pdMS_TO_TICKS(left);
+    if (ticks == 0) ticks = 1;               // below a tick, not a spin
+    if (ticks < wait) wait = ticks;
+  }
+  ulTaskNotifyTake(pdTRUE, wait);
+}
+
+
+/*
+ * Arm a loop() timer ms from now, then every period ms if that is not 0
+ */
+void timerStart(int id, unsigned long ms, unsigned long period) {
+  loopTimer_t* t = &loopTimers[id];
+  t->due = millis() + ms;
+  t->period = period;
+  t->armed = true;
+}
+
+
+/*
+ * Disarm a loop() timer
+ */
+void timerStop(int id) {
+  loopTimers[id].armed = false;
+}
+
+
+/*
+ * True once when a loop() timer fires, a periodic one is armed again
+ */
+bool timerDue(int id) {
+  loopTimer_t* t = &loopTimers[id];
+  unsigned long now = millis();
+  if (!t->armed || (long)(now - t->due) < 0) return false;
+  if (t->period == 0) t->armed = false;
+  else {
+    t->due += t->period;                      // keeps its beat
+    if ((long)(now - t->due) >= 0) t->due = now + t->period;  // unless far behind
+  }
+  return true;
+}
+
+
+/*
+ * Cut the wait in loopWait() short
+ */
+void loopWake(void) {
+  if (loopTaskHandle) xTaskNotifyGive(loopTaskHandle);
+}
+
+
+/*
+ * Set up the encoder pins and their isrs
+ */
+void inputBegin(void) {
+  pinMode(ROTARY_ENCODER_A_PIN, INPUT);       // the ky040 has the pull ups
+  pinMode(ROTARY_ENCODER_B_PIN, INPUT);
+  pinMode(ROTARY_ENCODER_BUTTON_PIN, INPUT);
+  inputAB = (digitalRead(ROTARY_ENCODER_B_PIN) << 1) | digitalRead(ROTARY_ENCODER_A_PIN);
+  inputDown = digitalRead(ROTARY_ENCODER_BUTTON_PIN) == LOW;
+  // Every pin waits on a level rather than an edge, the one it is not at
+  // now. A level is what light sleep can wake on (see pmBegin), and the
+  // isrs flip it on every change so it never fires twice for one.
+  attachInterrupt(digitalPinToInterrupt(ROTARY_ENCODER_A_PIN), readEncoderISR,
+                  (inputAB & 1) ? ONLOW : ONHIGH);
+  attachInterrupt(digitalPinToInterrupt(ROTARY_ENCODER_B_PIN), readEncoderISR,
+                  (inputAB & 2) ? ONLOW : ONHIGH);
+  attachInterrupt(digitalPinToInterrupt(ROTARY_ENCODER_BUTTON_PIN), readButtonISR,
+                  inputDown ? ONHIGH : ONLOW);
+}
+
+
+/*
+ * Queue an event for loop(), from the isrs only
+ */
+void IRAM_ATTR inputPush(uint32_t ms, int8_t type, int8_t delta) {
+  uint32_t head = inputHead;
+  if (head - inputTail >= INPUT_QUEUE) {
+    inputLost++;         // loop() is far behind, keep the oldest
+    return;
+  }
+  input_t* ev = &inputQueue[head % INPUT_QUEUE];
+  ev->ms = ms;
+  ev->type = type;
+  ev->delta = delta;
+  __sync_synchronize();  // the event is in place before the head moves
+  inputHead = head + 1;
+
+  // end the loop() wait now, a turn or press is what it waits for
+  BaseType_t woken = pdFALSE;
+  if (loopTaskHandle) vTaskNotifyGiveFromISR(loopTaskHandle, &woken);
+  if (woken) portYIELD_FROM_ISR();
+}
+
+
+/*
+ * Quadrature decoder, on every edge of either encoder pin
+ */
+void IRAM_ATTR readEncoderISR(void) {
+  // direction of each old state -> new state move, 0 for none or a bounce
+  static const DRAM_ATTR int8_t moves[16] = {
+    0, -1, 1, 0, 1, 0, 0, -1, -1, 0, 0, 1, 0, 1, -1, 0 };
+  int ab = (digitalRead(ROTARY_ENCODER_B_PIN) << 1) | digitalRead(ROTARY_ENCODER_A_PIN);
+  gpioWaitLevel(ROTARY_ENCODER_A_PIN, !(ab & 1));  // both wait for their next change
+  gpioWaitLevel(ROTARY_ENCODER_B_PIN, !(ab & 2));
+  inputAB = ((inputAB << 2) | ab) & 0x0f;
+  inputSteps += moves[inputAB];
+  if (inputSteps >= ROTARY_ENCODER_STEPS || inputSteps <= -ROTARY_ENCODER_STEPS) {
+    inputPush(millis(), INPUT_TURN, (inputSteps > 0) ? -1 : 1);  // clockwise is up
+    inputSteps = 0;
+  }
+}
+
+
+/*
+ * Button isr, on the level it was waiting for
+ */
+void IRAM_ATTR readButtonISR(void) {
+  bool low = digitalRead(ROTARY_ENCODER_BUTTON_PIN) == LOW;
+  gpioWaitLevel(ROTARY_ENCODER_BUTTON_PIN, low);  // light sleep wakes on it too
+  uint32_t now = millis();
+  if (now - inputButtonMs < INPUT_DEBOUNCE_MS) return;  // contact bounce
+  if (low == inputDown) {
+    // the change before this one came inside a bounce and was not counted
+    inputPush(now, low ? INPUT_RELEASE : INPUT_PRESS, 0);
+  }
+  inputDown = low;
+  inputButtonMs = now;
+  inputPush(now, low ? INPUT_PRESS : INPUT_RELEASE, 0);
+  if (low) {
+    if (now - inputLastPress < INPUT_DOUBLE_MS) inputPush(now, INPUT_DOUBLE, 0);
+    inputLastPress = now;
+  }
+}
+
+
+/*
+ * Arm a pin's level interrupt for the level it is not at, from an isr
+ */
+void IRAM_ATTR gpioWaitLevel(int pin, bool low) {
+  // gpio_set_intr_type() lives in flash, which is off to isrs while nvs
+  // or LittleFS write, so the pin register is set here instead
+  GPIO.pin[pin].int_type = low ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL;
+}
+
+
+/*
+ * Note a move of the portal switch and wake loop() to act on it
+ */
+void IRAM_ATTR portalSwitchISR(void) {
+  bool low = digitalRead(PORTAL_PIN) == LOW;
+  gpioWaitLevel(PORTAL_PIN, low);  // light sleep wakes on it too
+  portalSwitch = low;
+  BaseType_t woken = pdFALSE;
+  if (loopTaskHandle) vTaskNotifyGiveFromISR(loopTaskHandle, &woken);
+  if (woken) portYIELD_FROM_ISR();
+}
+
+
+/*
+ * Take the oldest event, false when there is none
+ */
+bool inputRead(input_t* ev) {
+  uint32_t tail = inputTail;
+  if (tail == inputHead) return false;
+  __sync_synchronize();  // read the event only after seeing the head
+  *ev = inputQueue[tail % INPUT_QUEUE];
+  inputTail = tail + 1;
+  return true;
+}
+
+
+/*
+ * Drop the events not read yet
+ */
+void inputFlush(void) {
+  inputTail = inputHead;
+}
+
+
+/*
+ * The button went down
+ */
+void inputPress(uint32_t ms, bool twice) {
+  if (volLevel == 0) {
+    // Handle timer or sleep mode
+    oledClear();
+
+    if (timerRunning && twice) {
+      // If user presses button within 3 seconds of timer set (a double
+      // click, INPUT_DOUBLE_MS) when the volume is zero, then fall into
+      // cpu light-sleep mode. Note that if the timer is running, then the 
+      // first click will be caught by the timer cancel code. It then
+      // takes 2 more clicks to power down. The isr timed the presses,
+      // however long loop() took to see them.
+      systemPowerDown();
+    }
+
+    else {
+      // Set or reset sleep timer when volume is zero
+      if (timerRunning) {
+        runSleepTimer(false);
+        oled.println(F("CANCEL TIMER"));
+      }
+      else {
+        runSleepTimer(true);
+        sleepStartTime = ms;  // from the press, not from now
+        oled.println(F("TIMER SET")); 
+        oled.print(SLEEP_TIMER/60000); // convert to minutes
+        oled.println(F(" minutes"));  
+      }
+    }
+  }
+
+  else {
+    if (menuOpen) { 
+      // close the menu, prepare selected stream
+      menuOpen = false;
+      currentIndex = menuIndex;  // user chose this stream
+      audioSend(AUDIO_CMD_STOP, 0); // stop stream download
+      systemStreaming = false;   // signal that another stream is selected
+      oledStatusDisplay();
+    }
+
+    else { 
+      // open the menu, select a stream
+      menuOpen = true;
+      menuDisplay(currentIndex);  // show stream selection list
+      audioSend(AUDIO_CMD_WARM, menuIndex); // pre-connect around it
+    }
+  }
+
+  displayOn = true;
+  timerStart(TIMER_OLED, OLED_TIMER); // tickle the display timer
+}
+
+
+/*
+ * The knob moved one detent, +1 up or -1 down
+ */
+void inputTurn(int delta, uint32_t ms) {
+  if (menuOpen) {  
+    // scroll the menu, one station a detent
+    menuIndex += delta;
+    if (menuIndex >= stationLive->count) menuIndex = 0; // wrap around
+    if (menuIndex < 0) menuIndex = stationLive->count-1;
+
+    menuDisplay(menuIndex);  // show stream selection list
+    audioSend(AUDIO_CMD_WARM, menuIndex); // pre-connect around it
+  }
+
+  else { 
+    // Menu is not open, so set the volume level, in bigger steps the
+    // faster the detents come
+    // volLevel value will be saved when oled timeout occurs
+    uint32_t gap = ms - inputTurnMs;
+    int step = 1;
+    if (gap < INPUT_ACCEL_MS) step = min(1 + INPUT_ACCEL_MS / (int)max(gap, (uint32_t)1), INPUT_ACCEL_MAX);
+    volLevel = constrain(volLevel + delta * step, 0L, 100L);
+    audioSend(AUDIO_CMD_VOLUME, volLevel); // set speaker level
+    oledStatusDisplay();  
+  }
+  inputTurnMs = ms;
+
+  displayOn = true;
+  timerStart(TIMER_OLED, OLED_TIMER); // tickle the display timer
+}
+
+
+/*
+ * Make a time shift store for the pause, loop() only
+ */
+bool shiftOpen(void) {
+  size_t want = (size_t)SHIFT_MINUTES * 60 * jitterKbps * 125;  // kbps -> bytes/s
+  shiftPages = (uint8_t*)malloc(3 * SHIFT_PAGE);
+  if (!shiftPages) return false;
+  shiftAsk = 0;
+
+  // psram needs no care, the file is only used without it
+  size_t psram = heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM);
+  if (psram > SHIFT_PSRAM_SPARE + SHIFT_MIN_PAGES * SHIFT_PAGE) {
+    shiftCapacity = min(want, psram - SHIFT_PSRAM_SPARE) / SHIFT_PAGE * SHIFT_PAGE;
+    shiftRam = (uint8_t*)heap_caps_malloc(shiftCapacity, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  }
+  if (!shiftRam && LittleFS.begin(true)) {
+    LittleFS.remove(SHIFT_FILE);  // what an earlier pause left
+    size_t room = LittleFS.totalBytes() - LittleFS.usedBytes();
+    shiftCapacity = (room > SHIFT_FS_SPARE) ? 
+                    min(want, room - SHIFT_FS_SPARE) / SHIFT_PAGE * SHIFT_PAGE : 0;
+    if (shiftCapacity >= SHIFT_MIN_PAGES * SHIFT_PAGE) 
+      shiftFile = LittleFS.open(SHIFT_FILE, "w+");
+  }
+  if (!shiftRam && !shiftFile) {
+    Serial.println(F("Time shift: no room"));
+    shiftClose();
+    return false;
+  }
+
+  shiftWritten = shiftRead = 0;
+  shiftBehind = 0;
+  shiftLost = 0;
+  Serial.printf("Time shift: %u s in %s\n", (unsigned)(shiftCapacity / 125 / jitterKbps),
+                shiftRam ? "psram" : "LittleFS");
+  return true;
+}
+
+
+/*
+ * Free the store once the audio task is done with it, loop() only
+ */
+void shiftClose(void) {
+  free(shiftPages);
+  shiftPages = NULL;
+  if (shiftRam) {
+    heap_caps_free(shiftRam);
+    shiftRam = NULL;
+  }
+  else if (shiftFile) {
+    shiftFile.close();
+    LittleFS.remove(SHIFT_FILE);
+  }
+  shiftCapacity = 0;
+  shiftBehind = 0;
+}
+
+
+/*
+ * Store the pages the audio task has filled and read back what it asks
+ * for, called from loop()
+ */
+void shiftService(void) {
+  if (shiftDone) {
+    shiftDone = false;
+    shiftClose();
+    return;
+  }
+  if (!shiftPages) return;
+
+  int ready = shiftReady;
+  if (ready >= 0) {
+    __sync_synchronize();  // the page as the audio task left it
+    shiftStore(shiftPages + ready * SHIFT_PAGE);
+    shiftReady = -1;
+  }
+  size_t ask = shiftAsk;
+  if (ask) {
+    shiftGot = shiftLoad(shiftPages + 2 * SHIFT_PAGE, ask);
+    __sync_synchronize();  // the bytes are in place before the answer
+    shiftAsk = 0;
+  }
+  shiftBehind = shiftWritten - shiftRead;
+}
+
+
+/*
+ * Append one page to the store, over the oldest once it is full
+ */
+void shiftStore(const uint8_t* page) {
+  size_t at = shiftWritten % shiftCapacity;  // a whole page, never split
+  if (shiftRam) memcpy(shiftRam + at, page, SHIFT_PAGE);
+  else if (!shiftFile.seek(at) || shiftFile.write(page, SHIFT_PAGE) != SHIFT_PAGE) 
+    Serial.println(F("Time shift: write failed"));
+  shiftWritten += SHIFT_PAGE;
+  if (shiftWritten - shiftRead > shiftCapacity) {
+    // paused for longer than the store holds, the oldest goes unheard,
+    // the decoder finds the next frame
+    shiftLost += shiftWritten - shiftRead - shiftCapacity;
+    shiftRead = shiftWritten - shiftCapacity;
+  }
+}
+
+
+/*
+ * Read up to len stored bytes in order, returns the bytes read
+ */
+size_t shiftLoad(uint8_t* buf, size_t len) {
+  size_t n = min((uint64_t)len, shiftWritten - shiftRead);
+  size_t done = 0;
+  while (done < n) {
+    size_t at = (shiftRead + done) % shiftCapacity;
+    size_t part = min(n - done, shiftCapacity - at);
+    if (shiftRam) memcpy(buf + done, shiftRam + at, part);
+    else if (!shiftFile.seek(at) || shiftFile.read(buf + done, part) != part) break;
+    done += part;
+  }
+  shiftRead += done;
+  return done;
+}
+
+
+/*
+ * Pause, or play on from the pause, for a long press
+ */
+void shiftToggle(void) {
+  shiftService();  // a finished shift is closed first
+  oledClear();
+  if (shiftState == SHIFT_PAUSED) {
+    audioSend(AUDIO_CMD_SHIFT, SHIFT_OP_RESUME);
+    oled.println(F("RESUME"));
+  }
+  else if (shiftState == SHIFT_BEHIND) {
+    audioSend(AUDIO_CMD_SHIFT, SHIFT_OP_PAUSE);
+    oled.println(F("PAUSED"));
+  }
+  else if (systemStreaming && !shiftPages && shiftOpen()) {
+    audioSend(AUDIO_CMD_SHIFT, SHIFT_OP_PAUSE);  // recording starts now
+    oled.println(F("PAUSED"));
+    oled.print(F("keeps "));
+    oled.print((unsigned)(shiftCapacity / 125 / jitterKbps));  // what the store holds
+    oled.println(F(" s"));
+  }
+  else oled.println(F("CANNOT PAUSE"));
+  displayOn = true;
+  timerStart(TIMER_OLED, OLED_TIMER); // tickle the display timer
+}
+
+
+/*
+ * Serve /shift, POST op=pause|resume|live changes it, the state as json
+ */
+void shiftHandle(AsyncWebServerRequest* request) {
+  if (!portalGate(request)) return;
+  const AsyncWebParameter* param = webArg(request, "op");
+  if (param) {
+    const String& op = param->value();
+    int arg;
+    if (strcmp(op.c_str(), "pause") == 0) arg = SHIFT_OP_PAUSE;
+    else if (strcmp(op.c_str(), "resume") == 0) arg = SHIFT_OP_RESUME;
+    else if (strcmp(op.c_str(), "live") == 0) arg = SHIFT_OP_LIVE;
+    else {
+      request->send(400, "text/plain", "op is pause, resume or live");
+      return;
+    }
+    if (!webPost(WEB_SHIFT, arg)) {
+      request->send(503, "text/plain", "Busy, try again");
+      return;
+    }
+  }
+  char json[80];
+  snprintf(json, sizeof(json), "{\"shift\":\"%s\",\"behind_ms\":%u,\"depth_ms\":%u}", 
+           shiftNames[shiftState], (unsigned)((uint64_t)shiftBehind * 8 / jitterKbps),
+           (unsigned)((uint64_t)shiftCapacity * 8 / jitterKbps));
+  request->send(200, "application/json", json);
+}
+
+
+/*
+ * Where the audio task puts network bytes while shifted, 0 when the
+ * pages are full and loop() has yet to store one
+ */
+size_t shiftWritePtr(uint8_t** ptr) {
+  if (shiftFill == SHIFT_PAGE) {
+    if (shiftReady >= 0) return 0;  // the network waits in the tcp window
+    __sync_synchronize();  // the page is in place before loop() sees it
+    shiftReady = shiftPage;
+    shiftPage ^= 1;
+    shiftFill = 0;
+    loopWake();
+  }
+  *ptr = shiftPages + shiftPage * SHIFT_PAGE + shiftFill;
+  return SHIFT_PAGE - shiftFill;
+}
+
+
+/*
+ * Mark len network bytes written to the page
+ */
+void shiftCommit(size_t len) {
+  shiftFill += len;
+}
+
+
+/*
+ * Refill the jitter buffer from the recording, back to live once it is
+ * played out, audio task only
+ */
+void shiftFeed(void) {
+  if (shiftAsk) return;  // loop() is still at it
+  if (shiftAsked) {
+    shiftAsked = false;
+    __sync_synchronize();  // the answer before the bytes
+    size_t got = shiftGot;
+    if (got > 0) {
+      jitterPut(shiftPages + 2 * SHIFT_PAGE, got);
+    }
+    else if (shiftReady < 0 && jitterSize - jitterCount >= shiftFill) {
+      // all stored is played, the page being filled is the rest, and
+      // the network carries on right after it
+      jitterPut(shiftPages + shiftPage * SHIFT_PAGE, shiftFill);
+      shiftFill = 0;
+      shiftEnd();
+    }
+    return;
+  }
+  if (jitterSize - jitterCount < SHIFT_PAGE) return;  // ask for whole pages
+  shiftGot = 0;
+  __sync_synchronize();
+  shiftAsk = SHIFT_PAGE;
+  shiftAsked = true;
+  loopWake();
+}
+
+
+/*
+ * Back to live, loop() closes the store, audio task only
+ */
+void shiftEnd(void) {
+  if (shiftState == SHIFT_LIVE) return;
+  shiftState = SHIFT_LIVE;
+  if (!shiftRam) profileSelect(outputProfile);  // the flash is left alone again
+  __sync_synchronize();
+  shiftDone = true;
+  loopWake();
+}
+
+
+/*
+ * Serve GET /stats
+ */
+void statsHandle(AsyncWebServerRequest* request) {
+  char* json = (char*)malloc(STATS_JSON_SIZE);
+  if (!json) {
+    request->send(503, "text/plain", "no memory");
+    return;
+  }
+  statsJson(json, STATS_JSON_SIZE);
+  request->send(200, "application/json", json);
+  free(json);
+}
+
+
+/*
+ * Send a command to the audio task
+ */
+void audioSend(int cmd, long arg) {
+  audioCmd_t msg = {cmd, arg};
+  xQueueSend(audioQueue, &msg, portMAX_DELAY);
+}
+
+
+/*
+ * Stop the audio stream and wait for the audio task to let go of it
+ */
+void audioStop(void) {
+  audioSend(AUDIO_CMD_STOP, 0);
+  unsigned long start = millis();
+  while (audioActive && (millis() - start < AUDIO_STOP_WAIT)) delay(10);
+}
+
+
+/*
+ * Enable or disable sleep timer
+ */
+void runSleepTimer(bool enabled) {
+  // enabled = true to set, false to clear
+  timerRunning = enabled;
+  if (enabled) {
+    sleepStartTime = millis();  // sleep timer baseline
+    timerStart(TIMER_SLEEP, SLEEP_TIMER);
+  }
+  else timerStop(TIMER_SLEEP);
+}
+
+
+/*
+ * Display the timer, signal, volume level
+ */
+void oledStatusDisplay(void) {
+
+  char line[OLED_COLS + 1];
+  int row = 0;
+  int dBm = wifiSignal();
+  const char* quality;
+  if (dBm >= -30)  quality = "excellent";
+  else if (dBm >= -67 ) quality = "good";
+    else if (dBm >= -70 ) quality = "fair";
+      else if (dBm >= -80 ) quality = "weak";
+        else quality = "very weak";
+
+  oledFrame();
+  oledRow(row++, streamsGetTag(currentIndex)); // stream name
+  if (timerRunning) {
+    char left[OLED_COLS + 1];
+    timerTimeLeft(left, sizeof(left));
+    snprintf(line, sizeof(line), "timer : %s", left);
+    oledRow(row++, line);
+  }
+  snprintf(line, sizeof(line), "signal: %d %s", dBm, quality);
+  oledRow(row++, line);
+  snprintf(line, sizeof(line), "volume: %ld", volLevel);
+  oledRow(row++, line);
+  while (row < OLED_ROWS) oledRow(row++, "");
+}
+
+
+/*
+ * Display the stream title, returns false if there is none
+ */
+bool nowPlayingDisplay(void) {
+  char title[ICY_TITLE_SIZE];
+
+  portENTER_CRITICAL(&nowTitleMux);
+  strcpy(title, nowTitle);
+  portEXIT_CRITICAL(&nowTitleMux);
+  if (title[0] == 0) return false;  // station sends no title
+
+  Serial.print(F("Now Playing: "));
+  Serial.println(title);
+
+  oledFrame();
+  oledRow(0, streamsGetTag(currentIndex)); // stream name
+  // wrap the title over the remaining rows
+  int len = strlen(title);
+  for (int row=1; row<OLED_ROWS; row++) {
+    int start = (row - 1) * OLED_COLS;
+    oledRow(row, start < len ? title + start : "");
+  }
+  return true;
+}
+
+
+/*
+ * Start the web server with every page it serves
+ */
+void webBegin(void) {
+  webQueue = xQueueCreate(WEB_QUEUE_LEN, sizeof(webCmd_t));
+  webServer.on("/stats", HTTP_GET, statsHandle);
+  webServer.on("/profile", HTTP_GET | HTTP_POST, profileHandle);
+  webServer.on("/room", HTTP_GET | HTTP_POST, roomHandle);
+  webServer.on("/probes", HTTP_GET, probesHandle);
+  webServer.on("/shift", HTTP_GET | HTTP_POST, shiftHandle);
+  webServer.on("/", HTTP_GET, [](AsyncWebServerRequest* request) {
+    if (portalGate(request)) request->redirect("/param");
+  });
+  webServer.on("/param", HTTP_GET, portalPage);
+  webServer.on("/param", HTTP_POST, portalSaveDone, NULL, portalSaveBody);
+  webServer.on("/update", HTTP_GET, portalUpdatePage);
+  webServer.on("/update", HTTP_POST, portalUpdateDone, portalUpdateChunk);
+  webServer.begin();
+}
+
+
+/*
+ * Hand a control request to loop(), false when too many are waiting
+ */
+bool webPost(int cmd, int arg) {
+  webCmd_t msg = {cmd, arg};
+  if (xQueueSend(webQueue, &msg, 0) != pdTRUE) return false;
+  loopWake();
+  return true;
+}
+
+
+/*
+ * The argument of a control change, from the form or the query of a POST,
+ * NULL when there is none or it came with a GET, which only reads
+ */
+const AsyncWebParameter* webArg(AsyncWebServerRequest* request, const char* name) {
+  if (request->method() != HTTP_POST) return NULL;
+  if (request->hasParam(name, true)) return request->getParam(name, true);
+  if (request->hasParam(name)) return request->getParam(name);
+  return NULL;
+}
+
+
+/*
+ * Apply the control requests from the web server, in loop()
+ */
+void webService(void) {
+  webCmd_t msg;
+  while (xQueueReceive(webQueue, &msg, 0) == pdTRUE) {
+    switch (msg.cmd) {
+      case WEB_PROFILE:
+        profileSet(msg.arg);
+        break;
+      case WEB_ROOM:
+        roomSet(msg.arg);
+        break;
+      case WEB_SHIFT:
+        if (msg.arg == SHIFT_OP_LIVE) audioSend(AUDIO_CMD_SHIFT, SHIFT_OP_LIVE);
+        else if ((msg.arg == SHIFT_OP_PAUSE) != (shiftState == SHIFT_PAUSED)) shiftToggle();
+        break;
+    }
+  }
+}
+
+
+/*
+ * True when the station pages may be served, otherwise answers for them
+ */
+bool portalGate(AsyncWebServerRequest* request) {
+  if (portalMode == PORTAL_UP) return true;
+  request->send(404, "text/plain", "Portal is off, set the switch to PORTAL");
+  return false;
+}
+
+
+/*
+ * Station page, every station then PORTAL_SPARE blank slots
+ */
+void portalPage(AsyncWebServerRequest* request) {
+  if (!portalGate(request)) return;
+  // the render state lives in the callback, freed along with the response
+  portalPage_t page;
+  page.slot = -1;
+  page.slots = min(stationLive->count + PORTAL_SPARE, STATION_MAX);
+  page.len = page.sent = 0;
+  request->send(request->beginChunkedResponse("text/html",
+    [page](uint8_t* buf, size_t maxLen, size_t index) mutable -> size_t {
+      return portalChunk(&page, buf, maxLen);
+    }));
+}
+
+
+/*
+ * Fill the next chunk of the station page, 0 when it is all sent
+ */
+size_t portalChunk(portalPage_t* page, uint8_t* buf, size_t maxLen) {
+  size_t n = 0;
+  while (n < maxLen) {
+    if (page->sent == page->len) {
+      if (page->slot > page->slots) break;  // the tail is out
+      portalLine(page);
+    }
+    size_t part = min(maxLen - n, page->len - page->sent);
+    memcpy(buf + n, page->line + page->sent, part);
+    page->sent += part;
+    n += part;
+  }
+  return n;
+}
+
+
+/*
+ * Render the head, one station slot, or the tail of the page
+ */
+void portalLine(portalPage_t* page) {
+  char* line = page->line;
+  size_t size = sizeof(page->line);
+  size_t len;
+  int i = page->slot++;
+
+  if (i < 0) {
+    // the save goes out as a plain body, so the server keeps no fields
+    len = snprintf(line, size, 
+      "<!DOCTYPE html><html><head><meta name=viewport "
+      "content=\"width=device-width\"><title>Aether Streamer</title>"
+      "<script>function save(f){fetch('/param',{method:'POST',"
+      "headers:{'Content-Type':'%s'},"
+      "body:new URLSearchParams(new FormData(f)).toString()})"
+      ".then(r=>r.text()).then(t=>{alert(t);location.reload();});"
+      "return false;}</script></head><body><h3>Stations</h3>"
+      "<noscript>Saving needs javascript</noscript>"
+      "<form onsubmit=\"return save(this)\">", PORTAL_FORM_TYPE);
+  }
+  else if (i < page->slots) {
+    len = snprintf(line, size, "<p>Name %d<br><input name=t%d maxlength=%d value=\"",
+                   i+1, i, STATION_NAME_SIZE-1);
+    len += portalEscape(line + len, size - len, streamsGetTag(i));
+    len += snprintf(line + len, size - len, 
+                    "\"><br>URL %d<br><input name=u%d maxlength=%d size=40 value=\"",
+                    i+1, i, CONN_URL_SIZE-1);
+    len += portalEscape(line + len, size - len, streamsGetUrl(i));
+    len += snprintf(line + len, size - len, "\"></p>");
+  }
+  else {
+    len = snprintf(line, size, "<button type=submit>Save</button></form>"
+                   "<p><a href=/update>Firmware update</a></p></body></html>");
+  }
+  page->len = min(len, size - 1);
+  page->sent = 0;
+}
+
+
+/*
+ * Copy text for a quoted html attribute, returns the length written
+ */
+size_t portalEscape(char* out, size_t size, const char* text) {
+  // the line is sized for the worst case, entities are never cut
+  size_t len = 0;
+  for (; *text; text++) {
+    const char* put;
+    char c[2] = { *text, 0 };
+    switch (*text) {
+      case '&': put = "&amp;"; break;
+      case '"': put = "&quot;"; break;
+      case '<': put = "&lt;"; break;
+      default: put = c;
+    }
+    size_t n = strlen(put);
+    if (len + n >= size) break;
+    memcpy(out + len, put, n);
+    len += n;
+  }
+  out[len] = 0;
+  return len;
+}
+
+
+/*
+ * Station form arriving, parsed as it comes into the spare set
+ */
+void portalSaveBody(AsyncWebServerRequest* request, uint8_t* data, size_t len, 
+                    size_t index, size_t total) {
+  if (portalMode != PORTAL_UP) return;  // portalSaveDone() answers
+  if (index == 0) {
+    // one save at a time builds the spare, a stalled one is overtaken
+    portalForm_t* form = (portalForm_t*)malloc(sizeof(portalForm_t));
+    if (!form) return;
+    memset(form, 0, sizeof(portalForm_t));
+    form->tagSlot = -1;
+    request->_tempObject = form;  // the server frees it with the request
+    if (portalBuildStart && millis() - portalBuildStart < PORTAL_BUILD_TIMEOUT) return;
+    form->build = ++portalBuild;
+    portalBuildStart = millis() | 1;
+    stationsEmpty(stationsSpare());
+  }
+  portalForm_t* form = (portalForm_t*)request->_tempObject;
+  if (!form || form->build != portalBuild || !form->build) return;  // not ours
+
+  for (size_t i=0; i<len; i++) portalFormChar(form, data[i]);
+  if (index + len >= total) {
+    // the last field has no '&' after it
+    portalFormField(form);
+    if (form->tagSlot >= 0) portalFormPair(form, form->tag, "");
+  }
+}
+
+
+/*
+ * Station form received, swap the new table in
+ */
+void portalSaveDone(AsyncWebServerRequest* request) {
+  if (!portalGate(request)) return;
+  portalForm_t* form = (portalForm_t*)request->_tempObject;
+  if (!form) {
+    request->send(400, "text/plain", "Save needs the portal page");
+    return;
+  }
+  if (!form->build || form->build != portalBuild) {
+    request->send(503, "text/plain", "Another save is running, save again");
+    return;
+  }
+  portalBuildStart = 0;  // the spare is free again
+  if (form->fields == 0) {
+    request->send(400, "text/plain", "No stations in the form");
+    return;
+  }
+  if (xSemaphoreTake(stationLock, pdMS_TO_TICKS(PORTAL_LOCK_WAIT)) != pdTRUE) {
+    request->send(503, "text/plain", "Busy, save again");
+    return;
+  }
+  stationsSwap();
+  xSemaphoreGive(stationLock);
+  portalSaved = true;
+  loopWake();
+  request->send(200, "text/plain", form->full ? form->full : "Saved");
+}
+
+
+/*
+ * Take one character of the urlencoded form
+ */
+void portalFormChar(portalForm_t* form, char c) {
+  if (c == '&') {
+    portalFormField(form);
+    return;
+  }
+  if (!form->inValue) {
+    if (c == '=') form->inValue = true;
+    else if (form->keyLen < PORTAL_KEY_SIZE-1) form->key[form->keyLen++] = c;
+    return;
+  }
+  if (form->pct) {
+    // second half of a %XX escape, or the first
+    int digit = isdigit(c) ? c - '0' : (isxdigit(c) ? (tolower(c) - 'a' + 10) : -1);
+    if (digit < 0) {
+      form->pct = 0;  // not an escape after all, drop it
+      return;
+    }
+    form->hex = form->hex * 16 + digit;
+    if (++form->pct < 3) return;
+    c = form->hex;
+    form->pct = 0;
+  }
+  else if (c == '%') {
+    form->pct = 1;
+    form->hex = 0;
+    return;
+  }
+  else if (c == '+') c = ' ';
+  if (form->valueLen < sizeof(form->value)-1) form->value[form->valueLen++] = c;
+}
+
+
+/*
+ * A field is complete, t<n> holds a name, u<n> the url of that slot
+ */
+void portalFormField(portalForm_t* form) {
+  form->key[form->keyLen] = 0;
+  form->value[form->valueLen] = 0;
+  if (form->keyLen > 1 && (form->key[0] == 't' || form->key[0] == 'u')) {
+    int slot = atoi(form->key + 1);
+    form->fields++;
+    if (form->key[0] == 't') {
+      if (form->tagSlot >= 0) portalFormPair(form, form->tag, "");  // no url came
+      strlcpy(form->tag, form->value, sizeof(form->tag));
+      form->tagSlot = slot;
+    }
+    else {
+      portalFormPair(form, (form->tagSlot == slot) ? form->tag : "", form->value);
+    }
+  }
+  form->keyLen = form->valueLen = 0;
+  form->inValue = false;
+  form->pct = 0;
+}
+
+
+/*
+ * Add a name and url from the form, blank pairs are dropped
+ */
+void portalFormPair(portalForm_t* form, const char* tag, const char* url) {
+  form->tagSlot = -1;
+  if (!tag[0] && !url[0]) return;
+  if (form->full) return;
+  stationSet_t* spare = stationsSpare();
+  if (stationsAppend(spare, tag, url)) return;
+  // say which cap it hit, usually the arena
+  if (spare->count >= STATION_MAX) form->full = "Saved, the table is full, the rest were dropped";
+  else form->full = "Saved, the names and addresses fill the 12K table, the rest were dropped";
+}
+
+
+/*
+ * Firmware upload form
+ */
+void portalUpdatePage(AsyncWebServerRequest* request) {
+  if (!portalGate(request)) return;
+  request->send(200, "text/html", 
+    "<!DOCTYPE html><html><body><h3>Firmware update</h3>"
+    "<form method=POST action=/update enctype=multipart/form-data>"
+    "<input type=file name=firmware accept=.bin> "
+    "<button type=submit>Update</button></form></body></html>");
+}
+
+
+/*
+ * Firmware upload, written to the ota partition as it arrives
+ */
+void portalUpdateChunk(AsyncWebServerRequest* request, const String& filename, 
+                       size_t index, uint8_t* data, size_t len, bool final) {
+  if (portalMode != PORTAL_UP) {
+    // the switch went off, or never was on, portalUpdateDone() answers
+    if (Update.isRunning()) Update.abort();
+    return;
+  }
+  if (index == 0) {
+    Serial.printf("Firmware update from %s\n", filename.c_str());
+    if (!Update.begin(UPDATE_SIZE_UNKNOWN)) return;
+  }
+  if (!Update.isRunning()) return;  // failed earlier
+  if (Update.write(data, len) != len) Update.abort();
+  else if (final) Update.end(true);
+}
+
+
+/*
+ * Firmware upload finished, loop() restarts into it
+ */
+void portalUpdateDone(AsyncWebServerRequest* request) {
+  if (!portalGate(request)) return;
+  bool ok = Update.isFinished() && !Update.hasError();
+  request->send(200, "text/plain", ok ? "Updated, restarting" : "Update failed");
+  if (ok) {
+    portalRestart = true;
+    loopWake();
+  }
+}
+
+
+/*
+ * Display the stream configuration portal message
+ */
+void StreamPortalMessage(void) {
+
+  oledClear();
+  oled.println(F("PORTAL OPEN"));
+  oled.print(WiFi.localIP());
+  oled.println(F("/param"));
+}
+
+
+/*
+ * Display the Wifi configuration portal message
+ */
+void wifiPortalMessage(void) {
+
+  oledClear();
+  oled.println(F("WIFI PORTAL"));
+  oled.println(F("Configure at"));
+  oled.print(F("ssid: "));
+  oled.println(portalName);
+  oled.println(F("ip:   192.168.4.1"));
+}
+
+
+/*
+ * Return the minutes left on the timer
+ */
+void timerTimeLeft(char* buf, size_t size) {
+
+    sleepCurrentTime = millis(); // set baseline
+
+    // calculate time left
+    long totalSeconds = SLEEP_TIMER/1000 - ((sleepCurrentTime - sleepStartTime)/1000);
+    int minutes = (totalSeconds % 3600) / 60;
+    snprintf(buf, size, "%d mins", minutes);
+}
+
+
+/*
+ * Display the stream selection menu
+ */
+void menuDisplay(int menuIndex) {
+  
+  char label[OLED_COLS + 1];  // marked name, or number in place of a bad item
+  oledFrame();
+  oledRow(0, streamsGetTag(currentIndex));  // title line
+
+  // previous line item
+  int lineIndex = (menuIndex == 0 ? (stationLive->count-1) : menuIndex-1);
+  oledRow(1, menuLabel(lineIndex, label, sizeof(label)));
+  
+  // current line item, the selection line
+  oledRow(2, menuLabel(menuIndex, label, sizeof(label)), checkProtocol(menuIndex));
+  
+  // next line item
+  lineIndex = (menuIndex == (stationLive->count-1) ? 0 : menuIndex+1);
+  oledRow(3, menuLabel(lineIndex, label, sizeof(label)));
+}
+
+
+/*
+ * Menu text of a station, its name, marked when it is dead, or its number
+ */
+const char* menuLabel(int index, char* buf, size_t size) {
+  if (!checkProtocol(index)) snprintf(buf, size, "%d", index+1);
+  else if (probeDead(index)) snprintf(buf, size, PROBE_DEAD_MARK "%s", streamsGetTag(index));
+  else return streamsGetTag(index);
+  return buf;
+}
+
+
+/*
+ * Clear the panel before printing to it directly
+ */
+void oledClear(void) {
+  oled.clear();
+  oledModelValid = false;  // the model no longer knows what is shown
+}
+
+
+/*
+ * Prepare for a screen built with oledRow()
+ */
+void oledFrame(void) {
+  // only clears the panel when something else was drawn in between
+  if (oledModelValid) return;
+  oled.clear();
+  for (int row=0; row<OLED_ROWS; row++) {
+    memset(oledModel[row], ' ', OLED_COLS);
+    oledModel[row][OLED_COLS] = 0;
+    oledInvert[row] = false;
+  }
+  oledModelValid = true;
+}
+
+
+/*
+ * Show text on a row, sending only the columns that changed
+ */
+void oledRow(int row, const char* text, bool invert) {
+  char line[OLED_COLS + 1];
+  
+  // pad to the full width, so old text is overwritten with spaces
+  int len = strlen(text);
+  if (len > OLED_COLS) len = OLED_COLS;
+  memcpy(line, text, len);
+  memset(line + len, ' ', OLED_COLS - len);
+  line[OLED_COLS] = 0;
+
+  // find the span that differs, an inverted row changing mode is redrawn
+  int first = 0;
+  int last = OLED_COLS - 1;
+  if (invert == oledInvert[row]) {
+    while (first < OLED_COLS && line[first] == oledModel[row][first]) first++;
+    if (first == OLED_COLS) return;  // nothing changed
+    while (line[last] == oledModel[row][last]) last--;
+  }
+
+  oled.setCursor(first * OLED_CHAR_WIDTH, row);
+  oled.setInvertMode(invert);
+  for (int col=first; col<=last; col++) oled.write(line[col]);
+  oled.setInvertMode(false);
+
+  memcpy(oledModel[row], line, OLED_COLS);
+  oledInvert[row] = invert;
+}
+
+
+/*
+ * Return the wifi signal in dBm, read at most every RSSI_TIMER
+ */
+int wifiSignal(void) {
+  if (!rssiRead || millis() - rssiTime > RSSI_TIMER) {
+    rssiValue = WiFi.RSSI();
+    rssiTime = millis();
+    rssiRead = true;
+  }
+  return rssiValue;
+}
+
+
+/*
+ * Return true if the url protocol text is correct
+ */
+bool checkProtocol(int menuIndex) {
+  const char* url = streamsGetUrl(menuIndex);
+  return strncmp(url, "http://", 7) == 0 || strncmp(url, "https://", 8) == 0;
+}
+
+
+/*
+ * Retrieve a persistent preference setting from the cache
+ */
+int settingGet(const char* setting) {
+  int i = settingFind(setting);
+  return i < 0 ? 0 : settingValue[i];  // default = 0
+}
+
+
+/*
+ * Store a persistent preference setting, nvs is written later
+ */
+void settingPut(const char* setting, int settingVal) {
+  int i = settingFind(setting);
+  if (i < 0 || settingValue[i] == settingVal) return;  // nothing to do
+  settingValue[i] = settingVal;
+  settingDirty[i] = true;
+  settingsPending = true;
+  timerStart(TIMER_SETTINGS, SETTINGS_FLUSH_DELAY);  // restart the quiet period
+}
+
+
+/*
+ * Return the cache slot of a setting key, -1 if it is not cached
+ */
+int settingFind(const char* setting) {
+  for (int i=0; i<(int)SETTINGS_COUNT; i++) {
+    if (setting == settingKeys[i] || strcmp(setting, settingKeys[i]) == 0) return i;
+  }
+  Serial.printf("Unknown setting %s\n", setting);
+  return -1;
+}
+
+
+/*
+ * Fill the settings cache from prefs
+ */
+void settingsLoad(void) {
+  prefs.begin(settings, PREF_RO);
+  for (int i=0; i<(int)SETTINGS_COUNT; i++) {
+    settingValue[i] = prefs.getInt(settingKeys[i], 0); // default = 0
+    settingDirty[i] = false;
+  }
+  prefs.end();
+  settingsPending = false;
+}
+
+
+/*
+ * Write the changed settings to prefs
+ */
+void settingsFlush(void) {
+  if (!settingsPending) return;
+  prefs.begin(settings, PREF_RW);
+  for (int i=0; i<(int)SETTINGS_COUNT; i++) {
+    if (settingDirty[i]) prefs.putInt(settingKeys[i], settingValue[i]);
+    settingDirty[i] = false;
+  }
+  prefs.end();
+  settingsPending = false;
+}
+
+
+/*
+ * Write back the settings once they have stopped changing
+ */
+void settingsService(void) {
+  if (timerDue(TIMER_SETTINGS)) settingsFlush();
+}
+
+
+/*
+ * Read the station health table of the last run, all of it due again
+ */
+void probesLoad(void) {
+  probeStore_t* store = (probeStore_t*)malloc(sizeof(probeStore_t));
+  if (!store) return;
+  prefs.begin(probePrefs, PREF_RO);
+  size_t len = prefs.getBytes(tableKey, store, sizeof(probeStore_t));
+  prefs.end();
+  if (len == sizeof(probeStore_t) && store->magic == PROBE_MAGIC &&
+      store->crc == crc32((const uint8_t*)store, offsetof(probeStore_t, crc))) {
+    memcpy(probes, store->slots, sizeof(probes));
+    for (int i=0; i<PROBE_SLOTS; i++) probes[i].at = 0;  // millis() has started over
+  }
+  free(store);
+}
+
+
+/*
+ * Write the station health table to prefs, at most every PROBE_SAVE_DELAY
+ */
+void probesService(void) {
+  if (!probesDirty || millis() - probesSaved < PROBE_SAVE_DELAY) return;
+  probeStore_t* store = (probeStore_t*)malloc(sizeof(probeStore_t));
+  if (!store) return;
+  probesDirty = false;  // before the copy, so a result landing meanwhile is kept
+  store->magic = PROBE_MAGIC;
+  memcpy(store->slots, probes, sizeof(probes));  // the audio task may be writing,
+  store->crc = crc32((const uint8_t*)store, offsetof(probeStore_t, crc));  // the copy is whole
+  prefs.begin(probePrefs, PREF_RW);
+  prefs.putBytes(tableKey, store, sizeof(probeStore_t));
+  prefs.end();
+  probesSaved = millis();
+  free(store);
+}
+
+
+/*
+ * Read the last good wifi connection from prefs
+ */
+bool wifiCacheLoad(wifiCache_t* cache) {
+  prefs.begin(wifiPrefs, PREF_RO);
+  size_t len = prefs.getBytes(cacheKey, cache, sizeof(wifiCache_t));
+  prefs.end();
+  return len == sizeof(wifiCache_t) && cache->magic == WIFI_CACHE_MAGIC &&
+         cache->crc == crc32((const uint8_t*)cache, offsetof(wifiCache_t, crc));
+}
+
+
+/*
+ * Remember the connection just made, for the next boot
+ */
+void wifiCacheSave(void) {
+  wifiCache_t cache, old;
+  memset(&cache, 0, sizeof(cache));
+  cache.magic = WIFI_CACHE_MAGIC;
+  const uint8_t* bssid = WiFi.BSSID();
+  if (bssid) memcpy(cache.bssid, bssid, sizeof(cache.bssid));
+  cache.channel = WiFi.channel();
+  cache.leaseBoots = wifiLeaseBoots;
+  IPAddress ip, gateway, mask, dns;
+  if (!wifiStatic(&ip, &gateway, &mask, &dns)) {
+    // a static address is set here, not learned
+    cache.ip = WiFi.localIP();
+    cache.gateway = WiFi.gatewayIP();
+    cache.mask = WiFi.subnetMask();
+    cache.dns = WiFi.dnsIP();
+  }
+  cache.crc = crc32((const uint8_t*)&cache, offsetof(wifiCache_t, crc));
+
+  if (wifiCacheLoad(&old) && memcmp(&old, &cache, sizeof(cache)) == 0) return;
+  prefs.begin(wifiPrefs, PREF_RW);
+  prefs.putBytes(cacheKey, &cache, sizeof(cache));
+  prefs.end();
+}
+
+
+/*
+ * The static address from WIFI_STATIC_IP, false when dhcp is used
+ */
+bool wifiStatic(IPAddress* ip, IPAddress* gateway, IPAddress* mask, IPAddress* dns) {
+  if (!ip->fromString(WIFI_STATIC_IP)) return false;
+  if (!gateway->fromString(WIFI_STATIC_GATEWAY)) return false;
+  if (!mask->fromString(WIFI_STATIC_MASK)) return false;
+  if (!dns->fromString(WIFI_STATIC_DNS)) *dns = *gateway;
+  return true;
+}
+
+
+/*
+ * Join the cached access point directly, without a scan or dhcp
+ */
+bool wifiFastConnect(void) {
+  wifiCache_t cache;
+  if (!wifiCacheLoad(&cache)) return false;
+
+  // the credentials are the ones WiFiManager left in the wifi nvs
+  WiFi.mode(WIFI_STA);
+  wifi_config_t conf;
+  if (esp_wifi_get_config(WIFI_IF_STA, &conf) != ESP_OK || !conf.sta.ssid[0]) return false;
+
+  IPAddress ip, gateway, mask, dns;
+  bool lease = false;
+  if (wifiStatic(&ip, &gateway, &mask, &dns)) WiFi.config(ip, gateway, mask, dns);
+  else if (cache.ip && cache.leaseBoots < WIFI_LEASE_BOOTS) {
+    WiFi.config(IPAddress(cache.ip), IPAddress(cache.gateway), 
+                IPAddress(cache.mask), IPAddress(cache.dns));
+    lease = true;
+  }
+
+  unsigned long start = millis();
+  WiFi.begin((const char*)conf.sta.ssid, (const char*)conf.sta.password, 
+             cache.channel, cache.bssid);
+  while (WiFi.status() != WL_CONNECTED && millis() - start < WIFI_FAST_TIMEOUT) delay(10);
+  if (WiFi.status() == WL_CONNECTED) {
+    Serial.printf("WiFi fast connect in %lu ms%s\n", millis() - start,
+                  lease ? ", cached lease" : "");
+    wifiLeaseBoots = lease ? cache.leaseBoots + 1 : 0;
+    return true;
+  }
+
+  // the ap has moved, or the lease is no good, forget it and scan
+  Serial.println(F("WiFi fast connect failed"));
+  WiFi.disconnect();
+  WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));
+  prefs.begin(wifiPrefs, PREF_RW);
+  prefs.remove(cacheKey);
+  prefs.end();
+  return false;
+}
+
+
+/*
+ * Bring the radio back after a power down
+ */
+bool wifiResume(void) {
+  // the driver still holds the ap, channel and address of the last join
+  unsigned long start = millis();
+  if (esp_wifi_start() != ESP_OK) return false;
+  esp_wifi_connect();
+  while (WiFi.status() != WL_CONNECTED && millis() - start < WIFI_RESUME_TIMEOUT) delay(10);
+  if (WiFi.status() != WL_CONNECTED) return false;
+  Serial.printf("WiFi resumed in %lu ms\n", millis() - start);
+  return true;
+}
+
+
+/*
+ * Startup times, power on to the first sound
+ */
+void bootPrint(void) {
+  Serial.printf("%s: wifi %u ms, stream %u ms, first pcm %u ms\n",
+    bootStartUs ? "Wake" : "Boot",
+    (unsigned)((bootWifiUs - bootStartUs) / 1000), 
+    (unsigned)((bootConnUs - bootStartUs) / 1000), 
+    (unsigned)((bootPcmUs - bootStartUs) / 1000));
+}
+
+
+/*
+ * Load the station table with streams that are saved in prefs object
+ */
+void populateStreams(void) {  
+  // This function will initialize default streams when nvs is blank
+  // You can manually re-load the default streams by pulling STREAM_PIN low at boot.
+
+  unsigned long start = millis();
+  if (stationsLoad()) {
+    Serial.printf("Stations loaded in %lu ms\n", millis() - start);
+    return;  // the usual case
+  }
 
   // place a marker key to indicate that the prefs is populated
   prefs.begin(settings, PREF_RO);
@@ -762,57 +5453,291 @@ void populateStreams(void) {
     prefs.end(); 
     initializeStreams();
   }
+  else if (stationsMigrate() == 0) {
+    // populated by an older version, converted to the station blob
+    // unless nothing was found, then the blob was lost, start over
+    initializeStreams();
+  }
+}
+
+
+/*
+ * Read the station table blob into the live set, returns false if unusable
+ */
+bool stationsLoad(void) {
+  stationSet_t* set = stationLive;
+  bool ok = false;
+
+  prefs.begin(stations, PREF_RO);
+  size_t len = prefs.getBytesLength(tableKey);
+  if (len > sizeof(stationTable_t) && stationsReserve(set, len - sizeof(stationTable_t), 0)) {
+    prefs.getBytes(tableKey, set->table, len);
+    if (set->table->magic == STATION_MAGIC && set->table->version == 1) {
+      prefs.end();
+      return stationsUpgrade(len);  // rewrites the blob
+    }
+    ok = set->table->magic == STATION_MAGIC && 
+         set->table->version == STATION_VERSION &&
+         set->table->size == len - sizeof(stationTable_t);
+  }
+  prefs.end();
+
+  if (!ok) {
+    if (len) Serial.println(F("Station table is stale"));
+    streamsClear();
+    return false;
+  }
+  if (set->table->crc != crc32((uint8_t*)set->table->items, set->table->size) || !stationsIndex()) {
+    Serial.println(F("Station table is damaged"));
+    streamsClear();
+    return false;
+  }
+  return true;
+}
+
+
+/*
+ * Rebuild the station index by walking the arena
+ */
+bool stationsIndex(void) {
+  // every station is two strings, the last must end inside the arena
+  stationSet_t* set = stationLive;
+  int count = set->table->count;
+  char* items = set->table->items;
+  size_t pos = 0;
+
+  set->count = 0;
+  if (!stationsReserve(set, 0, count)) return false;
+  for (set->count=0; set->count < count; set->count++) {
+    set->index[set->count] = pos;
+    for (int str=0; str<2; str++) {
+      char* end = (char*)memchr(items + pos, 0, set->table->size - pos);
+      if (!end) return false;
+      pos = end - items + 1;
+    }
+  }
+  return pos == set->table->size;
+}
+
+
+/*
+ * Convert a version 1 blob, read into the live table, to the packed layout
+ */
+bool stationsUpgrade(size_t len) {
+  stationTableV1_t* old = (stationTableV1_t*)malloc(sizeof(stationTableV1_t));
+  if (!old) return false;
+  bool ok = (len == sizeof(stationTableV1_t));
+  if (ok) {
+    memcpy(old, stationLive->table, len);
+    ok = old->crc == crc32((uint8_t*)old->items, sizeof(old->items));
+  }
+  if (ok) {
+    Serial.println(F("Upgrading station table"));
+    streamsClear();
+    for (int item=0; item < LEGACY_ITEMS; item++) {
+      char* tag = old->items + item * LEGACY_ITEM_SIZE;
+      char* url = tag + LEGACY_ELEMENT_SIZE;
+      tag[LEGACY_ELEMENT_SIZE-1] = url[LEGACY_ELEMENT_SIZE-1] = 0;
+      if (tag[0] || url[0]) streamsAdd(tag, url);
+    }
+    populatePrefs();
+  }
+  free(old);
+  if (!ok) streamsClear();
+  return ok;
+}
+
 
-  // fill steamsX with names and urls from prefs
-  for (int item=0; item < TOTAL_ITEMS; item++) {
+/*
+ * Convert the per item namespaces of older versions to the station blob
+ */
+int stationsMigrate(void) {
+  // returns the number of items found in the old layout
+  int found = 0;
+  char tag[LEGACY_ELEMENT_SIZE];
+  char url[LEGACY_ELEMENT_SIZE];
+
+  Serial.println(F("Migrating station table"));
+  streamsClear();
+  for (int item=0; item < LEGACY_ITEMS; item++) {
     prefs.begin(stream_item[item], PREF_RW); 
-    // check for key existence and place a blank string if missing
-    if (!prefs.isKey(stream_type[TYPE_TAG])) prefs.putString(stream_type[TYPE_TAG], "");
-    if (!prefs.isKey(stream_type[TYPE_URL])) prefs.putString(stream_type[TYPE_URL], "");
-    // get the values and place in streamsX array
-    streamsPut(item, prefs.getString(stream_type[TYPE_TAG]).c_str(), 
-                     prefs.getString(stream_type[TYPE_URL]).c_str());
+    // missing keys leave a blank string
+    tag[0] = url[0] = 0;
+    if (prefs.isKey(stream_type[TYPE_TAG])) 
+      prefs.getString(stream_type[TYPE_TAG], tag, sizeof(tag));
+    if (prefs.isKey(stream_type[TYPE_URL])) {
+      prefs.getString(stream_type[TYPE_URL], url, sizeof(url));
+      found++;
+    }
+    if (tag[0] || url[0]) streamsAdd(tag, url);
+    prefs.clear();  // the old layout is no longer needed
     prefs.end();
   }
+  if (found) populatePrefs();
+  return found;
 }
 
 
 /*
- * Fill the prefs object with data from the streamsX array
+ * Fill the prefs object with data from the live station set
  */
 void populatePrefs(void) {
-  for (int item=0; item < TOTAL_ITEMS; item++) {
-    prefs.begin(stream_item[item], PREF_RW); 
-    prefs.clear();
-    prefs.putString(stream_type[TYPE_TAG], streamsGetTag(item));
-    prefs.putString(stream_type[TYPE_URL], streamsGetUrl(item));
-    prefs.end();
+  stationSet_t* set = stationLive;
+  unsigned long start = millis();
+
+  if (!stationsReserve(set, 0, 0)) return;  // nothing was ever allocated
+  set->table->magic = STATION_MAGIC;
+  set->table->version = STATION_VERSION;
+  set->table->count = set->count;
+  set->table->crc = crc32((uint8_t*)set->table->items, set->table->size);
+
+  size_t len = sizeof(stationTable_t) + set->table->size;
+  prefs.begin(stations, PREF_RW); 
+  if (prefs.putBytes(tableKey, set->table, len) != len)
+    Serial.println(F("Station table write failed"));
+  prefs.end();
+  Serial.printf("%d stations, %u bytes saved in %lu ms\n", 
+                set->count, len, millis() - start);
+}
+
+
+/*
+ * Compute the crc32 of a buffer
+ */
+uint32_t crc32(const uint8_t* data, size_t len) {
+  uint32_t crc = 0xFFFFFFFF;
+  while (len--) {
+    crc ^= *data++;
+    for (int bit=0; bit<8; bit++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+
+/*
+ * Make room for more bytes of names and urls and more stations
+ */
+bool stationsReserve(stationSet_t* set, size_t bytes, int count) {
+  // grows in steps, never shrinks, the first call allocates the header
+  size_t need = (set->table ? set->table->size : 0) + bytes;
+  if (need > STATION_ARENA_MAX || set->count + count > STATION_MAX) return false;
+
+  if (!set->table || need > set->cap) {
+    size_t cap = (need + STATION_GROW - 1) / STATION_GROW * STATION_GROW;
+    if (cap == 0) cap = STATION_GROW;
+    stationTable_t* table = (stationTable_t*)realloc(set->table, sizeof(stationTable_t) + cap);
+    if (!table) return false;
+    if (!set->table) table->size = 0;
+    set->table = table;
+    set->cap = cap;
+  }
+  if (set->count + count > set->indexCap) {
+    int cap = (set->count + count + STATION_INDEX_GROW - 1) / STATION_INDEX_GROW * STATION_INDEX_GROW;
+    uint16_t* index = (uint16_t*)realloc(set->index, cap * sizeof(uint16_t));
+    if (!index) return false;
+    set->index = index;
+    set->indexCap = cap;
+  }
+  return true;
+}
+
+
+/*
+ * Empty the live station table, the memory is kept for reuse
+ */
+void streamsClear(void) {
+  stationsEmpty(stationLive);
+}
+
+
+/*
+ * Append a stream tag and url to the live station table, false when full
+ */
+bool streamsAdd(const char* tag, const char* url) {
+  return stationsAppend(stationLive, tag, url);
+}
+
+
+/*
+ * Empty a station set, keeping its memory
+ */
+void stationsEmpty(stationSet_t* set) {
+  if (set->table) set->table->size = 0;
+  set->count = 0;
+}
+
+
+/*
+ * Add a station to the end of a set, names and urls too long are cut
+ */
+bool stationsAppend(stationSet_t* set, const char* tag, const char* url) {
+  size_t tagLen = strnlen(tag, STATION_NAME_SIZE-1);
+  size_t urlLen = strnlen(url, CONN_URL_SIZE-1);
+
+  if (!stationsReserve(set, tagLen + urlLen + 2, 1)) {
+    Serial.println(F("Station table is full"));
+    return false;
   }
+  char* item = set->table->items + set->table->size;
+  memcpy(item, tag, tagLen);
+  item[tagLen] = 0;
+  memcpy(item + tagLen + 1, url, urlLen);
+  item[tagLen + 1 + urlLen] = 0;
+
+  set->index[set->count++] = set->table->size;
+  set->table->size += tagLen + urlLen + 2;
+  return true;
+}
+
+
+/*
+ * The spare set, where an edit is built before stationsSwap()
+ */
+stationSet_t* stationsSpare(void) {
+  return (stationLive == &stationSets[0]) ? &stationSets[1] : &stationSets[0];
+}
+
+
+/*
+ * Make the spare set live, the old live set becomes the spare
+ */
+void stationsSwap(void) {
+  // one aligned pointer store, the readers never see half of it
+  stationLive = (stationLive == &stationSets[0]) ? &stationSets[1] : &stationSets[0];
+  stationsDirty = true;  // stationsService() stores it
 }
 
 
 /*
- * Put the stream tag and url strings into the streamsX array
+ * Store an edited station table, away from the task that made the edit
  */
-void streamsPut(int index, const char* tag, const char* url) {
-  strncpy( streamsX + (index * STREAM_ITEM_SIZE), tag, STREAM_ELEMENT_SIZE );
-  strncpy( streamsX + (index * STREAM_ITEM_SIZE + STREAM_ELEMENT_SIZE), url, STREAM_ELEMENT_SIZE );
+void stationsService(void) {
+  // the lock keeps the next edit off the set while it is written
+  if (!stationsDirty || xSemaphoreTake(stationLock, 0) != pdTRUE) return;
+  stationsDirty = false;
+  populatePrefs();
+  xSemaphoreGive(stationLock);
 }
 
 
 /*
- * Get the name tag string from the streamsX array at index
+ * Get the name tag string from the live station table at index
  */
-char* streamsGetTag(int index) { // index = 0..TOTAL_ITEMS-1
-  return streamsX + (index * STREAM_ITEM_SIZE);
+const char* streamsGetTag(int index) { // index = 0..count-1
+  stationSet_t* set = stationLive;
+  if (index < 0 || index >= set->count) return "";
+  return set->table->items + set->index[index];
 }
 
 
 /*
- * Get the url string from the streamsX array at index
+ * Get the url string from the live station table at index
  */
-char* streamsGetUrl(int index) { // index = 0..TOTAL_ITEMS-1
-  return streamsX + (index * STREAM_ITEM_SIZE + STREAM_ELEMENT_SIZE);
+const char* streamsGetUrl(int index) { // index = 0..count-1
+  stationSet_t* set = stationLive;
+  if (index < 0 || index >= set->count) return "";
+  const char* tag = set->table->items + set->index[index];
+  return tag + strlen(tag) + 1;  // url follows the name
 }
 
 
@@ -822,74 +5747,75 @@ char* streamsGetUrl(int index) { // index = 0..TOTAL_ITEMS-1
 void initializeStreams(void) {
   // This function clobbers any user entered streams.
 
-  oled.clear();
+  oledClear();
   oled.println("INITIALIZE");
   oled.print("Loading default\nstreams...\n");
   
-  // Default Streams (49 char name + 49 char url, +nulls)
-  char stream_data[72][50] = { // 72 elements of 50 chars (72/2=36 streams)
+  // Default Streams, a constant table, so it stays in flash
+  static constexpr struct {
+    const char* name;
+    const char* url;
+  } defaults[] = {
     // 1-10
-    "Psyndora Chillout","http://cast.magicstreams.gr:9125",          
-    "Psyndora Psytrance","http://cast.magicstreams.gr:9111",         
-    "Radio Play Emotions", "http://5.39.82.157:8054/stream",         
-    "Rare 80s Music", "http://209.9.238.4:9844/",                    
-    "Simply Oldies","http://uk5.internet-radio.com:8153",                 
-    "Skylark Stream", "http://uk2.internet-radio.com:8164/listen.ogg",
-    "Synphaera Radio","http://ice2.somafm.com/synphaera-128-mp3",     
-    "The Seagull","http://us5.internet-radio.com:8121",                  
-    "XRDS.fm","http://us1.internet-radio.com:8321",                      
-    "Ambient Radio", "http://uk2.internet-radio.com:8171/stream",     
+    {"Psyndora Chillout", "http://cast.magicstreams.gr:9125"},
+    {"Psyndora Psytrance", "http://cast.magicstreams.gr:9111"},
+    {"Radio Play Emotions", "http://5.39.82.157:8054/stream"},
+    {"Rare 80s Music", "http://209.9.238.4:9844/"},
+    {"Simply Oldies", "http://uk5.internet-radio.com:8153"},
+    {"Skylark Stream", "http://uk2.internet-radio.com:8164/listen.ogg"},
+    {"Synphaera Radio", "http://ice2.somafm.com/synphaera-128-mp3"},
+    {"The Seagull", "http://us5.internet-radio.com:8121"},
+    {"XRDS.fm", "http://us1.internet-radio.com:8321"},
+    {"Ambient Radio", "http://uk2.internet-radio.com:8171/stream"},
     // 11-20
-    "Best of Art Bell","http://108.161.128.117:8050",                 
-    "Big 80s Station","http://158.69.114.190:8024",                   
-    "Big Hair Radio","http://192.111.140.11:8508",                    
-    "Box UK Radio", "http://uk7.internet-radio.com:8226",                      
-    "Classical Radio","http://classicalradiostream.com:8010",               
-    "Dark Edge Radio","http://5.35.214.196:8000",                     
-    "Detroit Industrial Underground", "http://138.197.0.4:8000/stream",
-    "Dimensione Relax", "http://51.161.115.200:8012/stream",           
-    "Disco Funk","http://eu10.fastcast4u.com:8120",                      
-    "EarthSong Experimental","http://cast3.my-control-panel.com:7084/autodj", 
+    {"Best of Art Bell", "http://108.161.128.117:8050"},
+    {"Big 80s Station", "http://158.69.114.190:8024"},
+    {"Big Hair Radio", "http://192.111.140.11:8508"},
+    {"Box UK Radio", "http://uk7.internet-radio.com:8226"},
+    {"Classical Radio", "http://classicalradiostream.com:8010"},
+    {"Dark Edge Radio", "http://5.35.214.196:8000"},
+    {"Detroit Industrial Underground", "http://138.197.0.4:8000/stream"},
+    {"Dimensione Relax", "http://51.161.115.200:8012/stream"},
+    {"Disco Funk", "http://eu10.fastcast4u.com:8120"},
+    {"EarthSong Experimental", "http://cast3.my-control-panel.com:7084/autodj"},
     // 21-30
-    "First Amendment Radio","http://198.178.123.8:7862",                      
-    "Gothville", "http://gothville.radio:8000/stream",                   
-    "HardTecho and Schranz","http://schranz.in:8000",                    
-    "J-Pop Sakura","http://cast1.torontocast.com:2170",                  
-    "KXFU - RDSN.net","http://184.95.62.170:9788",                       
-    "Lounge Radio", "http://fr1.streamhosting.ch:80/lounge128.mp3",      
-    "Majestic Jukebox","http://uk3.internet-radio.com:8405",             
-    "Mangled Web Radio", "http://144.126.151.19:8000/mp3",               
-    "Megaton Cafe Radio","http://us2.internet-radio.com:8443",           
-    "Metal Express Radio","http://5.135.154.69:11590",                   
+    {"First Amendment Radio", "http://198.178.123.8:7862"},
+    {"Gothville", "http://gothville.radio:8000/stream"},
+    {"HardTecho and Schranz", "http://schranz.in:8000"},
+    {"J-Pop Sakura", "http://cast1.torontocast.com:2170"},
+    {"KXFU - RDSN.net", "http://184.95.62.170:9788"},
+    {"Lounge Radio", "http://fr1.streamhosting.ch:80/lounge128.mp3"},
+    {"Majestic Jukebox", "http://uk3.internet-radio.com:8405"},
+    {"Mangled Web Radio", "http://144.126.151.19:8000/mp3"},
+    {"Megaton Cafe Radio", "http://us2.internet-radio.com:8443"},
+    {"Metal Express Radio", "http://5.135.154.69:11590"},
     // 31-36
-    "Metal Rock Radio","http://kathy.torontocast.com:2800",              
-    "Mission Control Radio","http://151.80.42.191:8372",                 
-    "Moon Mission Recordings","http://uk5.internet-radio.com:8306",      
-    "Move Da House","http://uk7.internet-radio.com:8000",                
-    "Mr. Liberty Show","http://198.178.123.5:8258",                      
-    "Musical Ventur Radio","http://us3.internet-radio.com:8614"         
+    {"Metal Rock Radio", "http://kathy.torontocast.com:2800"},
+    {"Mission Control Radio", "http://151.80.42.191:8372"},
+    {"Moon Mission Recordings", "http://uk5.internet-radio.com:8306"},
+    {"Move Da House", "http://uk7.internet-radio.com:8000"},
+    {"Mr. Liberty Show", "http://198.178.123.5:8258"},
+    {"Musical Ventur Radio", "http://us3.internet-radio.com:8614"}
   };
 
-  for (int item=0; item < TOTAL_ITEMS; item++) {
-    // stuff the prefs object with default data
-    prefs.begin(stream_item[item], PREF_RW);
-    prefs.clear();
-    prefs.putString(stream_type[TYPE_TAG], stream_data[item*2]);
-    prefs.putString(stream_type[TYPE_URL], stream_data[item*2+1]);
-    prefs.end();
+  streamsClear();
+  for (size_t item=0; item < sizeof(defaults) / sizeof(defaults[0]); item++) {
+    // stuff the table with default data
+    streamsAdd(defaults[item].name, defaults[item].url);
 
     oled.setCursor(0, 3); // col, row
     oled.clearToEOL();
     oled.setCursor(0, 3);
-    oled.print(stream_data[item*2]);
+    oled.print(defaults[item].name);
   }
+  populatePrefs();          // store the table
   settingPut(listened, 0);  // default to first stream
 }
 
 /*
  * Create a version tag from compile time
  */
-String version(void) {
+void version(char* buf, size_t size) {
   // Extract date and time from __DATE__ and __TIME__
   const char monthStr[12][4] = {
       "Jan", "Feb", "Mar", "Apr", "May", "Jun", 
@@ -914,36 +5840,54 @@ String version(void) {
   int hour, minute, second;
   sscanf(__TIME__, "%d:%d:%d", &hour, &minute, &second);
 
-  // Format as "YYYYMMDD.HHMMSS"
-  char dateTimeString[20];
-  snprintf(dateTimeString, sizeof(dateTimeString), "%04d%02d%02d.%02d%02d",
+  // Format as "YYYYMMDD.HHMM"
+  snprintf(buf, size, "%04d%02d%02d.%02d%02d",
             year, monthNumber, day, hour, minute);
-
-  return String(dateTimeString);
 }
 
 
 /*
- * Put CPU to sleep. Reboot when wake up requested.
+ * Put CPU to light sleep, resume warm when the button is pressed
  */
 void systemPowerDown(void) {
+  char ver[VERSION_SIZE];
+  version(ver, sizeof(ver));
   oled.print(F("SYSTEM POWER DOWN\n\nv.")); // status notification
-  oled.print(version());
-  urlstream.end();          // stop stream download
+  oled.print(ver);
+  audioStop();              // stop stream download
+  settingsFlush();          // nothing may be left unsaved
   systemStreaming = false;  // set state signals
   systemSleeping = true;
   esp_sleep_enable_ext0_wakeup((gpio_num_t) ROTARY_ENCODER_BUTTON_PIN, LOW); // set the restart signal
   esp_wifi_stop();          // shut down wifi
   delay(OLED_TIMER);
-  oled.clear();
+  oledClear();
   esp_light_sleep_start();  // put cpu to sleep
 
   // CPU is now in sleep mode. ZZZzzzz
 
-  // code will resume here when restart signal is asserted
-  oled.println(F("SYSTEM RESTART")); // notification
-  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
-  esp_restart();            // reboot cpu
+  // Code resumes here when restart signal is asserted. Light sleep keeps
+  // all of ram, so the stations, settings and caches are still here and
+  // only the radio needs bringing back. The audio task restarts i2s
+  // itself when it is told to play.
+  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_EXT0);
+  bootStartUs = esp_timer_get_time();
+  bootConnUs = bootPcmUs = 0;
+  oled.println(F("WAKE UP")); // notification
+  if (!wifiResume()) {
+    oled.println(F("SYSTEM RESTART"));
+    esp_restart();          // wifi is not coming back, boot afresh
+  }
+  bootWifiUs = esp_timer_get_time();
+
+  // the press that woke us is not a click
+  while (digitalRead(ROTARY_ENCODER_BUTTON_PIN) == LOW) delay(10);
+  inputFlush();
+
+  systemSleeping = false;   // loop() starts the last station
+  runSleepTimer(timerRunning);  // reset timer
+  displayOn = true;
+  timerStart(TIMER_OLED, OLED_TIMER); // tickle the display timer
 }
 
 
@@ -951,7 +5895,7 @@ void systemPowerDown(void) {
  * Wipe the NVS memory (wifi, prefs, etc.)
  */
 void wipeNVS(void) {
-  oled.clear();
+  oledClear();
   oled.print(F("NVS\nClearing Memory\n"));
   nvs_flash_erase();      // erase the NVS partition and...
   nvs_flash_init();       // initialize the NVS partition.
@@ -0,0 +1,130 @@
+/**
+ * framesync.h
+ *
+ * Frame sync for mp3 and adts aac streams, shared by the sketch and the
+ * native bench (bench/bench.cpp).
+ *
+ * The first bytes of a station are seldom the start of a frame: an id3
+ * tag, or the middle of a frame when the server joins us mid stream. Fed
+ * to helix as they are, they cost resync attempts and can click. The
+ * scanner looks for a sync word whose frame lengths chain through
+ * SYNC_FRAMES headers in a row, which chance data all but never does, and
+ * reads the stream format from those headers before anything is decoded.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define SYNC_FRAMES 3           // headers in a row that must chain
+#define SYNC_HEADER 7           // bytes read of each header, adts is longest
+#define SYNC_SCAN_BYTES 8192    // more than SYNC_FRAMES of the largest frames
+#define SYNC_MORE 0             // too few bytes to tell, call again with more
+#define SYNC_FOUND 1            // frames start at *skip, info is filled
+#define SYNC_SKIP 2             // nothing starts before *skip, drop that much
+
+// what the first frames tell of the stream
+struct sync_t {
+  int rate;                     // Hz, 0 for aac, where sbr may double it
+  int channels;                 // 1 or 2
+  int kbps;                     // mean of the frames checked
+};
+
+/*
+ * Length of the frame whose header is at p, 0 when there is none
+ * key is the part of the header that stays the same from frame to frame
+ */
+static inline size_t syncFrame(const uint8_t* p, bool aac, uint32_t* key, sync_t* info) {
+  if (p[0] != 0xFF) return 0;
+
+  if (aac) {
+    static const int rates[13] = {
+      96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350 };
+    if ((p[1] & 0xF6) != 0xF0) return 0;      // sync, layer 0
+    int sf = (p[2] >> 2) & 0x0F;
+    if (sf >= 13) return 0;
+    size_t len = ((p[3] & 0x03) << 11) | (p[4] << 3) | (p[5] >> 5);
+    if (len < SYNC_HEADER) return 0;
+    *key = (p[1] << 16) | ((p[2] & 0xFD) << 8) | (p[3] & 0xC0);  // all but the private bit
+    int ch = ((p[2] & 0x01) << 2) | (p[3] >> 6);
+    info->rate = 0;
+    info->channels = (ch == 1) ? 1 : 2;
+    info->kbps = len * 8 * rates[sf] / 1024 / 1000;  // 1024 samples a frame
+    return len;
+  }
+
+  // mpeg 1, 2 and 2.5 audio, layers 1 to 3
+  static const uint16_t kbps1[3][15] = {
+    {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+    {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+    {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320} };
+  static const uint16_t kbps2[3][15] = {
+    {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160} };
+  static const int rates[3] = {44100, 48000, 32000};
+  if ((p[1] & 0xE0) != 0xE0) return 0;
+  int version = (p[1] >> 3) & 3;              // 0 is 2.5, 1 none, 2 is 2, 3 is 1
+  int layer = 4 - ((p[1] >> 1) & 3);          // 4 is none
+  int bi = p[2] >> 4;                         // 0 is free format, not followed
+  int si = (p[2] >> 2) & 3;
+  if (version == 1 || layer == 4 || bi == 0 || bi == 15 || si == 3) return 0;
+  int rate = rates[si] >> ((version == 3) ? 0 : (version == 2) ? 1 : 2);
+  int kbps = (version == 3) ? kbps1[layer - 1][bi] : kbps2[layer - 1][bi];
+  int pad = (p[2] >> 1) & 1;
+  size_t len;
+  if (layer == 1) len = (12000 * kbps / rate + pad) * 4;
+  else if (layer == 3 && version != 3) len = 72000 * kbps / rate + pad;
+  else len = 144000 * kbps / rate + pad;
+  *key = ((p[1] & 0xFE) << 8) | (p[2] & 0x0C);  // version, layer and rate
+  info->rate = rate;
+  info->channels = ((p[3] >> 6) == 3) ? 1 : 2;
+  info->kbps = kbps;
+  return len;
+}
+
+/*
+ * Look for the first run of whole frames, returns SYNC_xxx
+ * Drop *skip bytes whatever the result. flush says no more bytes are
+ * coming for now, so a header is taken without the full run behind it.
+ */
+static inline int syncScan(const uint8_t* data, size_t len, bool aac, bool flush,
+                           sync_t* info, size_t* skip) {
+  *skip = 0;
+
+  // an id3v2 tag at the start, its size is 4 x 7 bits
+  if (!aac && len >= 3 && memcmp(data, "ID3", 3) == 0) {
+    if (len < 10) return SYNC_MORE;
+    *skip = 10 + ((data[6] & 0x7F) << 21 | (data[7] & 0x7F) << 14 |
+                  (data[8] & 0x7F) << 7 | (data[9] & 0x7F));
+    if (data[5] & 0x10) *skip += 10;          // and a footer
+    return SYNC_SKIP;
+  }
+
+  for (size_t i=0; i + SYNC_HEADER <= len; i++) {
+    uint32_t key, next;
+    sync_t frame;
+    size_t at = i + syncFrame(data + i, aac, &key, info);
+    if (at == i) continue;
+    int frames = 1;
+    int kbps = info->kbps;
+    while (frames < SYNC_FRAMES && at + SYNC_HEADER <= len) {
+      size_t n = syncFrame(data + at, aac, &next, &frame);
+      if (n == 0 || next != key) break;
+      at += n;
+      kbps += frame.kbps;
+      frames++;
+    }
+    if (frames < SYNC_FRAMES && at + SYNC_HEADER <= len) continue;  // chance sync
+    *skip = i;
+    if (frames < SYNC_FRAMES && !flush) return SYNC_MORE;  // see the rest first
+    info->kbps = kbps / frames;
+    return SYNC_FOUND;
+  }
+
+  // no frame starts here, keep what may be the start of a header
+  if (len < SYNC_HEADER) return SYNC_MORE;
+  *skip = len - SYNC_HEADER + 1;
+  return SYNC_SKIP;
+}
@@ -0,0 +1,72 @@
+/**
+ * gain.h
+ *
+ * Volume stage arithmetic, shared by the sketch and the native bench
+ * (bench/bench.cpp) so both measure the very same code.
+ *
+ * Gain is applied in place on the decoder pcm in Q15 fixed point. The knob
+ * follows a log curve, and a new level is ramped in across one pcm block
+ * so that fast turns do not step the output (zipper noise).
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#define VOLUME_LEVELS 101       // knob positions 0..100, 0 mutes
+#define VOLUME_RANGE_DB 50      // attenuation at level 1
+#define GAIN_UNITY 32768        // Q15 1.0
+//#define GAIN_FLOAT            // float scaling without ramps, for comparison
+
+/*
+ * Fill the Q15 gain of every knob position
+ */
+static inline void gainCurveBuild(int32_t* curve) {
+  curve[0] = 0;
+  for (int i=1; i<VOLUME_LEVELS; i++) {
+    float db = VOLUME_RANGE_DB * (float)(i - (VOLUME_LEVELS-1)) / (VOLUME_LEVELS-2);
+    curve[i] = lroundf(GAIN_UNITY * powf(10.0f, db / 20.0f));
+  }
+  curve[VOLUME_LEVELS-1] = GAIN_UNITY;  // exact, so 100 passes straight through
+}
+
+/*
+ * Scale a block of interleaved pcm, moving *gain to target across it
+ */
+static inline void gainApply(int16_t* pcm, size_t frames, int ch,
+                             int32_t* gain, int32_t target) {
+  size_t n = frames * ch;
+#ifdef GAIN_FLOAT
+  // the old VolumeStream arithmetic, one float multiply per sample
+  float factor = (float)target / GAIN_UNITY;
+  for (size_t i=0; i<n; i++) pcm[i] = pcm[i] * factor;
+  *gain = target;
+#else
+  int32_t g0 = *gain;
+  if (g0 == target) {
+    if (g0 == GAIN_UNITY) return;                // nothing to do
+    if (g0 == 0) {
+      memset(pcm, 0, n * sizeof(int16_t));       // muted
+      return;
+    }
+    // 16x16 products, a single mul16s each on the lx6
+    for (size_t i=0; i<n; i++) pcm[i] = (pcm[i] * g0) >> 15;
+    return;
+  }
+  if (frames == 0) return;
+
+  // Linear ramp across the block. The step is kept in Q30 so that small
+  // changes spread over a long block still move every frame.
+  // |sample * gain| <= 2^30, so the Q15 product cannot overflow or clip.
+  int32_t acc = g0 << 15;
+  int32_t step = ((target - g0) << 15) / (int32_t)frames;
+  for (size_t f=0; f<frames; f++) {
+    acc += step;
+    int32_t g = acc >> 15;
+    for (int c=0; c<ch; c++, pcm++) *pcm = (*pcm * g) >> 15;
+  }
+  *gain = target;
+#endif
+}
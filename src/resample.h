@@ -0,0 +1,71 @@
+/**
+ * resample.h
+ *
+ * Clock drift resampler, shared by the sketch and the native bench
+ * (bench/bench.cpp).
+ *
+ * The station encoder and the i2s clock never run at quite the same rate,
+ * so the player consumes a few hundred ppm more or less than arrives. The
+ * pcm is stretched or squeezed by that much with linear interpolation,
+ * which at such ratios moves the pitch by well under a cent and leaves no
+ * audible trace. The ratio is set in ppm and kept in Q32 so that single
+ * ppm steps are honoured.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define RESAMPLE_CHANNELS 2     // most channels handled, more pass through
+#define RESAMPLE_MAX_PPM 2000   // largest ratio offset accepted
+// most frames resampleRun() makes from the given input frames
+#define RESAMPLE_ROOM(frames) ((frames) + (frames) * RESAMPLE_MAX_PPM / 1000000 + 2)
+
+// stream state carried between blocks
+struct resample_t {
+  int64_t pos;                  // Q32 input position of the next output frame,
+                                // -1 is the last frame of the previous block
+  int16_t last[RESAMPLE_CHANNELS]; // that frame
+  bool primed;                  // last[] holds real audio
+};
+
+/*
+ * Start over, the next block is not joined to the previous one
+ */
+static inline void resampleReset(resample_t* rs) {
+  rs->pos = 0;
+  rs->primed = false;
+}
+
+/*
+ * Resample interleaved pcm into out, returns the frames written
+ * ppm > 0 consumes the input faster, so less comes out than went in
+ */
+static inline size_t resampleRun(resample_t* rs, const int16_t* in, size_t frames,
+                                 int ch, int16_t* out, int32_t ppm) {
+  if (frames == 0) return 0;
+  if (!rs->primed) {
+    for (int c=0; c<ch; c++) rs->last[c] = in[c];  // no click from silence
+    rs->pos = 0;
+    rs->primed = true;
+  }
+  if (ppm > RESAMPLE_MAX_PPM) ppm = RESAMPLE_MAX_PPM;
+  if (ppm < -RESAMPLE_MAX_PPM) ppm = -RESAMPLE_MAX_PPM;
+  int64_t step = (1LL << 32) + (int64_t)ppm * (1LL << 32) / 1000000;
+
+  size_t n = 0;
+  int64_t end = (int64_t)(frames - 1) << 32;  // in[frames-1] is needed as x1
+  while (rs->pos < end) {
+    int64_t i = rs->pos >> 32;                // -1 .. frames-2
+    int32_t f = (uint32_t)rs->pos >> 17;      // Q15 fraction
+    const int16_t* x0 = (i < 0) ? rs->last : in + i * ch;
+    const int16_t* x1 = in + (i + 1) * ch;
+    for (int c=0; c<ch; c++)
+      *out++ = x0[c] + (((x1[c] - x0[c]) * f) >> 15);
+    rs->pos += step;
+    n++;
+  }
+  rs->pos -= (int64_t)frames << 32;           // relative to the next block
+  for (int c=0; c<ch; c++) rs->last[c] = in[(frames - 1) * ch + c];
+  return n;
+}